@@ -25,5 +25,62 @@ struct fs_super_d {
 
     DiskUnit inodes;
     DiskUnit data;
+
+    uint32_t version; // on-disk format version, see FS_VERSION
+
+    // * Block groups, the units above describe group 0, group g lies
+    // * g * group_blocks blocks further. groups == 0 means a single group.
+    uint32_t groups;
+    uint32_t group_blocks;
+    uint32_t inodes_per_group;
+    uint32_t blocks_per_group;
+
+    uint32_t inode_size; // bytes per inode record, 0 means the FS_VERSION_V1 size
+
+    DiskUnit journal;    // metadata journal after the last group, 0 blocks if none
+
+    uint32_t state;      // FS_STATE_CLEAN after umount, FS_STATE_DIRTY while mounted
+    uint32_t generation; // incremented by every mount
+
+    // * Snapshot, snap_blocks == 0 if there is none
+    uint32_t snap_dir;        // dno of the first block of its map directory
+    uint32_t snap_blocks;     // blocks of the map directory
+    uint32_t snap_generation; // mount generation it was taken in
+
+    // * Since FS_VERSION 3 *
+    // * The checksum block of a group holds the CRC32C of each block of its
+    // * inode map slice, then of each block of its data map slice, over the
+    // * bytes of the slice in that block
+    DiskUnit csum;     // checksum block of group 0
+    uint32_t checksum; // CRC32C of the fields of its version with checksum set to 0
+
+    // * Since FS_VERSION 4 *
+    // * In log-structured mode the inode units hold the location table of
+    // * each group instead of its inode records: one entry per inode, the
+    // * record address dno * records per block + slot, or ~0 if none. The
+    // * checksum block then covers the table blocks after the bitmap blocks.
+    uint32_t log_segment; // blocks per segment, 0 for in-place updates
+    uint32_t log_head;    // next block of the log at umount
+};
+
+/**
+ * First block of the journal region
+ */
+struct fs_journal_d {
+    uint32_t magic;
+    uint32_t sequence; // the transaction to replay at mount must carry it
+};
+
+/**
+ * Transaction header, followed by nblocks block images in the journal.
+ * The header and the images are written in one I/O, checksum covers both
+ * so a torn transaction is never replayed.
+ */
+struct fs_journal_txn_d {
+    uint32_t magic;
+    uint32_t sequence;
+    uint32_t nblocks;
+    uint32_t checksum;  // computed with checksum itself set to 0
+    uint32_t blocknr[]; // home block of every image
 };
 
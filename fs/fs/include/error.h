@@ -3,8 +3,13 @@
 #define ERROR_SEEK          -ESPIPE     
 #define ERROR_ISDIR         -EISDIR
 #define ERROR_NOSPACE       -ENOSPC
+#define ERROR_NOMEM         -ENOMEM
+#define ERROR_FBIG          -EFBIG
 #define ERROR_EXISTS        -EEXIST
 #define ERROR_NOTFOUND      -ENOENT
+#define ERROR_NAMETOOLONG   -ENAMETOOLONG
 #define ERROR_UNSUPPORTED   -ENXIO
+#define ERROR_OPNOTSUPP     -EOPNOTSUPP
+#define ERROR_ROFS          -EROFS
 #define ERROR_IO            -EIO     /* Error Input/Output */
 #define ERROR_INVAL         -EINVAL  /* Invalid Args */
\ No newline at end of file
@@ -14,9 +14,34 @@
 #include "types.h"
 #include "stdint.h"
 #include "error.h"
+#include <linux/falloc.h>
 
 #define FS_MAGIC 0x20220915
+#define FS_VERSION_V0 0 /* fixed-length fs_dentry_d_v0 records */
+#define FS_VERSION_V1 1 /* variable-length fs_dentry_d records */
+#define FS_VERSION_V2 2 /* FS_INODE_SIZE inode records with inline data */
+#define FS_VERSION_V3 3 /* CRC32C checksums on all metadata */
+#define FS_VERSION 4    /* log-structured mode, selected at format */
 #define FS_DEFAULT_PERM 0777 /* 全权限打开 */
+#define FS_DEFAULT_CACHE 16384 /* KiB, 内存中dentry与inode的上限 */
+#define FS_DEFAULT_COMMIT 5    /* 秒, 脏数据最长停留时间, 到期由后台线程提交 */
+#define FS_FLUSH_PAGES 256     /* 脏页超过该数时后台线程提前写回 */
+#define FS_DIRTY_SOFT 512      /* 脏页软上限, 超过后写者按比例休眠 */
+#define FS_DIRTY_HARD 1024     /* 脏页硬上限, 达到后写者阻塞到写回完成 */
+#define FS_THROTTLE_MAX_US 20000 /* 接近硬上限时每次写的最长休眠 */
+#define FS_FLUSH_RETRIES 100   /* 后台线程让步于前台操作的次数, 每次1ms */
+#define FS_JOURNAL_MAGIC 0x4a524e4c
+#define FS_STATE_CLEAN 1        /* 正常卸载, 挂载时无需恢复 */
+#define FS_STATE_DIRTY 2        /* 已挂载或异常退出, 其他值按DIRTY处理 */
+#define FS_JOURNAL_BLOCKS 128  /* 日志区块数, 不超过磁盘的1/16 */
+#define FS_OP_INODES 4         /* 一次修改操作最多弄脏的inode数, 见journal_reserve */
+#define FS_SNAP_NAME "/.snapshot" /* 在根目录mkdir创建快照, rmdir删除快照 */
+#define FS_LOG_SEGMENT 32      /* 日志模式下每段的块数, 段是追加写与清理的单位 */
+#define FS_LOG_RESERVE 64      /* 日志模式下为inode记录, 目录块与清理保留的块数 */
+#define FS_LOG_CLEAN_LOW 8     /* 空闲段少于该数时后台清理 */
+#define FS_LOG_CLEAN_BATCH 4   /* 每次清理最多回收的段数 */
+#define FS_RESERVE_SHARDS 16   /* 预留块缓存的分片数, 写线程各自优先使用一个分片 */
+#define FS_RESERVE_BATCH 16    /* 分片每次从全局预留中取出的块数 */
 
 #define ROUND_DOWN(value, round) ((value) % (round) == 0 ? (value) : ((value) / (round)) * (round))
 #define ROUND_UP(value, round) ((value) % (round) == 0 ? (value) : ((value) / (round) + 1) * (round))
@@ -26,6 +51,21 @@
 
 #define BLK_ROUND_DOWN(off)     ROUND_DOWN(off,(super.params.size_block))
 #define BLK_ROUND_UP(off)      ROUND_UP(off,(super.params.size_block))
+
+/* 块组布局: | Super(1) | Group 0 | Group 1 | ... | Journal(*) |, 每个块组为
+ * | Inode Map(1) | DATA Map(1) | CSUM(1) | INODE(*) | DATA(*) |, CSUM为本组位图的校验和.
+ * 日志模式下INODE换为本组inode的位置表ITAB(1), inode记录与数据一起追加写入DATA */
+#define FS_BYTES_PER_INODE      4096  /* 格式化时每多少字节磁盘空间分配一个inode */
+#define FS_MIN_GROUPS           4     /* 小磁盘也至少划分的块组数 */
+#define FS_MIN_GROUP_BLOCKS     64    /* 块组过小时退化为单个块组 */
+#define FS_MAX_GROUP_BLOCKS     32768 /* 单个块组的块数上限, 位图可跨多个块 */
+
+#define INO_GROUP(ino)  ((ino) / super.ipg)
+#define DNO_GROUP(dno)  ((dno) / super.dpg)
+#define INODE_OFF(ino)  ((off_t)super.inodes_off + (off_t) INO_GROUP(ino) * super.group_size + \
+                         ((ino) % super.ipg) * super.inode_size)
+#define DATA_OFF(dno)   ((off_t)super.data_off + (off_t) DNO_GROUP(dno) * super.group_size + \
+                         ((dno) % super.dpg) * super.params.size_block)
 /******************************************************************************
  * SECTION: fs.c
  *******************************************************************************/
@@ -46,40 +86,165 @@ int fs_rmdir(const char *);
 int fs_rename(const char *, const char *);
 int fs_utimens(const char *, const struct timespec tv[2]);
 int fs_truncate(const char *, off_t);
+int fs_fallocate(const char *, int, off_t, off_t, struct fuse_file_info *);
 
 int fs_open(const char *, struct fuse_file_info *);
 int fs_opendir(const char *, struct fuse_file_info *);
+int fs_release(const char *, struct fuse_file_info *);
+int fs_releasedir(const char *, struct fuse_file_info *);
+int fs_flush(const char *, struct fuse_file_info *);
+int fs_fsync(const char *, int, struct fuse_file_info *);
+int fs_fsyncdir(const char *, int, struct fuse_file_info *);
 
 // * bitmap.c
-uint8_t *bitmap_init(uint32_t size);
-int bitmap_alloc(uint8_t *bitmap, uint32_t size);
-void bitmap_clear(uint8_t *bitmap, uint32_t index);
+struct bitmap *bitmap_init(uint32_t size);
+void bitmap_free(struct bitmap *bitmap);
+void bitmap_rebuild(struct bitmap *bitmap);
+uint32_t bitmap_bytes(struct bitmap *bitmap);
+void bitmap_set(struct bitmap *bitmap, uint32_t index);
+void bitmap_clear(struct bitmap *bitmap, uint32_t index);
+uint32_t bitmap_count_zero(struct bitmap *bitmap, uint32_t start, uint32_t end);
+int bitmap_test(struct bitmap *bitmap, uint32_t index);
+int bitmap_find_zero(struct bitmap *bitmap, uint32_t start);
+int bitmap_alloc(struct bitmap *bitmap);
+void bitmap_set_range(struct bitmap *bitmap, uint32_t start, uint32_t len);
+void bitmap_clear_range(struct bitmap *bitmap, uint32_t start, uint32_t len);
+int bitmap_alloc_range(struct bitmap *bitmap, uint32_t goal, uint32_t want, uint32_t min,
+                       uint32_t *len);
+
+// * crc32c.c
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+// * slab.c
+void *slab_alloc(struct slab_pool *pool);
+void slab_free(struct slab_pool *pool, void *obj);
+void slab_destroy(struct slab_pool *pool);
+void slab_stats(struct slab_pool *pool);
+
+// * alloc.c
+int ino_alloc(struct fs_inode *parent, FileType ftype);
+int ino_free(uint32_t ino);
+uint32_t dno_goal(struct fs_inode *inode);
+int dno_alloc(uint32_t goal, uint32_t want, uint32_t min, uint32_t *len);
+int dno_alloc_meta(uint32_t goal, uint32_t want, uint32_t *len);
+int dno_reserve(uint32_t cnt);
+void dno_unreserve(uint32_t cnt);
+void dno_rereserve(uint32_t cnt);
+void dno_drain();
+void dno_stats();
+int dno_free(uint32_t dno, uint32_t len);
+int dno_claim(uint32_t dno);
+int dno_fresh(uint32_t dno);
+int dno_freed(uint32_t dno);
+uint32_t dno_freed_count();
+void dno_commit();
+void dno_pending_free();
+void group_rebuild();
+
+// * flusher.c
+void fs_lock();
+void fs_lock_shared();
+void fs_unlock();
+void flusher_start();
+void flusher_kick();
+void flusher_throttle();
+void flusher_stop();
+
+// * journal.c
+int journal_format(off_t off, uint32_t blks);
+int journal_recover();
+void journal_begin();
+int journal_write(off_t offset, void *in_content, int size);
+int journal_preserve();
+int journal_commit();
+int journal_fsync(struct fs_inode *inode);
+void journal_reserve(uint32_t inodes);
+void journal_unreserve(uint32_t inodes);
+void journal_stats();
+void journal_destroy();
+
+// * snapshot.c
+void snap_load();
+void snap_unload();
+int snap_recover();
+int snap_cow(uint32_t blocknr);
+int snap_free(uint32_t dno);
+void snap_journal_taken();
+void snap_cow_range(off_t offset, int size);
+int snap_read(off_t offset, void *out_content, int size);
+int snap_create();
+int snap_delete();
+
+// * log.c
+int log_load(int is_init);
+void log_unload();
+uint32_t log_itab_csum(uint32_t g, uint32_t k);
+void log_journal_itab(uint32_t g);
+int log_alloc(uint32_t want, uint32_t min, uint32_t *len);
+off_t log_inode_off(uint32_t ino);
+int log_write_inodes(const uint32_t *inos, uint8_t *records, int n);
+void log_forget(uint32_t ino);
+int log_should_clean();
+int log_clean();
+void log_stats();
+
+// * cache.c
+size_t cache_usage();
+int cache_over();
+void cache_touch(struct fs_inode *inode);
+void cache_remove(struct fs_inode *inode);
+void cache_shrink(int writeback);
+void cache_mark_dirty(struct fs_inode *inode);
+void cache_mark_clean(struct fs_inode *inode);
+void cache_mark_synced(struct fs_inode *inode, uint32_t gen);
+uint32_t cache_dirty_gen(struct fs_inode *inode);
+int cache_is_dirty(struct fs_inode *inode);
+struct fs_inode *cache_dirty_pop();
+uint32_t cache_dirty_count();
+time_t cache_dirty_since();
+void cache_walk(void (*fn)(struct fs_inode *inode, void *arg), void *arg);
+void cache_destroy();
 
 // * file.c
 struct fs_dentry *dentry_create(const char *name, FileType ftype);
 struct fs_inode *inode_create();
+void dentry_free(struct fs_dentry *dentry);
+void inode_free(struct fs_inode *inode);
 void dentry_bind(struct fs_dentry *dentry, struct fs_inode *inode);
 void dentry_register(struct fs_dentry *dentry, struct fs_dentry *parent);
 void dentry_unregister(struct fs_dentry* dentry);
+int dentry_fits(struct fs_dentry *parent, const char *fname, int leaving);
 struct fs_dentry *dentry_get(struct fs_dentry *dentries, int index);
 int dentry_delete(struct fs_dentry* dentry);
-void inode_alloc(struct fs_inode *inode);
+void dentry_destroy(struct fs_dentry* dentry);
+int inode_alloc(struct fs_inode *inode, int size);
 
 char *get_fname(char *path);
 struct fs_dentry *dentries_find(struct fs_dentry *dentries, char *fname);
+int dentry_load(struct fs_dentry *dentry, int childs);
 int dentry_lookup(char *path, struct fs_dentry **dentry);
 
 
 // * disk.c
-int disk_read(int offset, void *out_content, int size);
-int disk_write(int offset, void *in_content, int size);
+int disk_read_live(off_t offset, void *out_content, int size);
+int disk_read(off_t offset, void *out_content, int size);
+int disk_write(off_t offset, void *in_content, int size);
 
 int file_read(struct fs_inode* file, int offset, void *buf, int size);
 int file_write(struct fs_inode* file, int offset, void *buf, int size);
+int file_flush(struct fs_inode* file);
+int file_fallocate(struct fs_inode* file, int mode, int offset, int len);
+int file_truncate(struct fs_inode* file, int offset);
+int file_uninline(struct fs_inode* file);
+void file_drop_pages(struct fs_inode* file);
 
 int inode_sync(struct fs_inode *inode);
+int disk_sync();
+int maps_load();
 int dentry_restore(struct fs_dentry *dentry, int ino);
+int dentry_restore_childs(struct fs_inode *inode);
 
+int super_write(uint32_t state);
 int disk_mount();
 int disk_umount();
 
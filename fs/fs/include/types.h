@@ -2,6 +2,8 @@
 #define _TYPES_H_
 
 #include "disk.h"
+#include <pthread.h>
+#include <time.h>
 
 #define MAX_NAME_LEN    128     
 #define MAX_BLOCK_PER_INODE  4
@@ -10,22 +12,119 @@ typedef enum file_type {
     FT_DIR,
 } FileType;
 
+#define BITMAP_MAX_LEVELS 5
+#define BITMAP_GROUP_BITS 4096
+
+/**
+ * In-Memory bitmap, see bitmap.c
+ *
+ * levels[0] has one bit per word that is full, levels[l] one bit per word
+ * of levels[l - 1] that is full, so a free bit is found in O(log n).
+ */
+struct bitmap {
+    uint64_t *words;
+    uint32_t nwords;
+    uint32_t size; // number of valid bits
+    uint32_t hint; // next-fit cursor, where the next search starts
+
+    uint32_t free;         // number of zero bits
+    uint32_t ngroups;
+    uint16_t *group_free;  // zero bits per BITMAP_GROUP_BITS bits
+    uint16_t *group_run;   // upper bound on the longest zero run inside each group
+
+    int nlevels;
+    uint32_t level_bits[BITMAP_MAX_LEVELS]; // number of entries summarized by levels[l]
+    uint64_t *levels[BITMAP_MAX_LEVELS];
+};
+
+/**
+ * Typed object pool, see slab.c
+ */
+struct slab_pool {
+    const char *name;
+    size_t obj_size;
+    int id;           // index of per-thread magazine, assigned on first use
+    uint32_t gen;     // bumped by slab_destroy to drop stale magazines
+
+    pthread_mutex_t lock;
+    void *free_list;
+    void *slabs;
+
+    uint32_t nslabs;
+    uint32_t live;    // objects handed out
+    uint32_t peak;    // max of live
+};
+
+#define SLAB_POOL_INIT(pool_name, type) \
+    { .name = pool_name, .obj_size = ROUND_UP(sizeof(type), sizeof(void *)), \
+      .lock = PTHREAD_MUTEX_INITIALIZER }
+
 struct custom_options {
 	const char*        device;
+	int                cache_size; // KiB of dentries and inodes kept in memory
+	int                commit;     // seconds between journal commits
+	int                snapshot;   // mount the snapshot read-only instead
+	int                log;        // format a new disk in log-structured mode
+	int                stats;      // print the counters of each subsystem at umount
+};
+
+/**
+ * In-Memory block group descriptor, rebuilt from the bitmaps at mount
+ */
+struct fs_group {
+    uint32_t free_inodes;
+    uint32_t free_blocks;
+    uint32_t imap_dirty; // bit k: block k of the group's inode map slice changed
+    uint32_t dmap_dirty;
+    uint32_t itab_dirty; // bit k: block k of the group's inode location table changed
 };
 
 struct fs_super {
     int      fd;
     DiskParam params;
+    uint32_t disk_blks;  // blocks on the device, params.size_disk read as unsigned
 
     uint32_t super_off;
     uint32_t imap_off;
     uint32_t dmap_off;
-    uint32_t inodes_off;
+    uint32_t inodes_off; // offsets of the regions in group 0
     uint32_t data_off;
+    uint32_t imap_blks;   // blocks of each region per group
+    uint32_t dmap_blks;
+    uint32_t inodes_blks;
+    uint32_t data_blks;
+
+    uint32_t groups;
+    uint32_t group_size; // bytes between the same region of adjacent groups
+    uint32_t ipg;        // inodes per group
+    uint32_t dpg;        // data blocks per group
+    struct fs_group *gd;
+    uint32_t reserved;   // data blocks promised to dirty pages without dno
+    uint32_t dirty_pages; // pages of all files waiting for writeback, updated atomically
+
+    uint32_t inode_size; // bytes per on-disk inode record
+    uint32_t inline_max; // bytes of inline data an inode record holds
+
+    struct bitmap* imap;
+    struct bitmap* dmap;
+
+    uint32_t version;
+    uint32_t generation; // mount count, see fs_super_d::generation
+
+    off_t journal_off;     // 0 if the image has no journal
+    uint32_t journal_blks;
+    uint32_t journal_seq;  // sequence number of the next transaction
+
+    uint32_t snap_dir;     // see fs_super_d::snap_dir
+    uint32_t snap_blks;    // 0 if there is no snapshot
+    uint32_t snap_generation;
 
-    uint8_t* imap;
-    uint8_t* dmap;
+    uint32_t csum_off;     // checksum block of group 0, 0 if metadata has no checksums
+    int readonly;          // a bitmap failed its checksum, nothing may be allocated or freed
+
+    uint32_t log_segment;  // blocks per segment, 0 unless the disk is log-structured
+    uint32_t log_head;     // next block the log appends to, see log_alloc
+    uint32_t* itab;        // record address of every inode in log-structured mode, see log.c
 
     struct fs_dentry *root;
 };
@@ -34,14 +133,32 @@ struct fs_inode {
     uint32_t ino;
     struct fs_dentry *self; 
 
+    // * Cache State *
+    int dirty; // whether the on-disk inode is stale
+    int nopen; // number of open handles, opened inodes are never evicted, updated atomically
+    int unlinked; // removed from its directory while open, the last release destroys it
+    pthread_rwlock_t lock; // data pages, inline data and size, see fs_read and fs_write
+    struct fs_inode *lru_prev;
+    struct fs_inode *lru_next;
+    struct fs_inode *dirty_prev; // on the dirty list while it needs writeback
+    struct fs_inode *dirty_next;
+    time_t dirtied; // when it joined the dirty list
+    uint32_t dirty_gen; // bumped by every cache_mark_dirty
+    uint32_t sync_gen;  // dirty_gen the running disk_sync writes back
+
     // * Directory Structure *
     int dir_cnt; // number of sub dentries
     struct fs_dentry *childs; // linked list of sub dentries
+    int childs_restored; // whether childs has been read from disk
     uint32_t dno_dir; // data block number
 
     // * Regular File Structure *
-    int size;
+    int size; // file size, or bytes of dentry records for directory
     uint32_t dno_reg[MAX_BLOCK_PER_INODE];
+    uint8_t *pages[MAX_BLOCK_PER_INODE]; // dirty blocks not yet written back
+    uint32_t unwritten; // bit i set: dno_reg[i] is preallocated and reads as zeros
+    uint8_t *inline_data; // super.inline_max bytes of data kept in the inode record, or NULL
+    uint32_t dir_csum;    // see fs_inode_tail_d::dir_csum
 };
 
 struct fs_dentry {
@@ -56,6 +173,11 @@ struct fs_dentry {
 
 };
 
+#define DNO_UNWRITTEN 0x80000000 // flag in fs_inode_d::dno_reg for unwritten blocks
+
+#define FS_INODE_SIZE 128 // bytes per on-disk inode record
+#define INODE_INLINE  0x1 // fs_inode_d::flags, data lives in inline_data
+
 struct fs_inode_d {
     uint32_t ino;
     // * Directory Structure *
@@ -65,9 +187,38 @@ struct fs_inode_d {
     // * Regular File Structure *
     int size;
     uint32_t dno_reg[MAX_BLOCK_PER_INODE];
+
+    // * Since FS_VERSION 2 *
+    uint32_t flags;
+    uint8_t inline_data[FS_INODE_SIZE - 9 * sizeof(uint32_t)];
 };
 
+/**
+ * Last bytes of every inode record since FS_VERSION 3, taken from inline_data
+ */
+struct fs_inode_tail_d {
+    uint32_t dir_csum; // CRC32C of the records in the directory block
+    uint32_t csum;     // CRC32C of the whole record with csum set to 0
+};
+
+/**
+ * On-disk directory record, records are packed back to back in the
+ * directory block and each one is padded to DENTRY_D_LEN(name_len).
+ */
 struct fs_dentry_d {
+    uint32_t ino;
+    uint16_t rec_len;  // length of the whole record, 8-byte aligned
+    uint8_t  name_len; // length of name, without '\0'
+    uint8_t  ftype;
+    char     name[];   // not '\0' terminated
+};
+
+#define DENTRY_D_LEN(name_len) ROUND_UP(sizeof(struct fs_dentry_d) + (name_len), 8)
+
+/**
+ * Fixed-length directory record used by FS_VERSION_V0 images
+ */
+struct fs_dentry_d_v0 {
     FileType ftype;
     char     name[MAX_NAME_LEN];
     uint32_t ino;
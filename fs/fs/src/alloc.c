@@ -0,0 +1,493 @@
+#define _GNU_SOURCE
+#include "../include/fs.h"
+
+extern struct fs_super super;
+
+/* Protects the bitmaps, the group counters, the reservation and the pending
+ * sets. Writers reserve blocks under the shared fs lock; recursive because
+ * freeing may log inode records, and copying for a snapshot allocates */
+static pthread_mutex_t alloc_lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
+/* Blocks counted in super.reserved but not yet promised to any page, split
+ * in shards so writers reserve without alloc_lock. A thread keeps using the
+ * shard it was given first, and refills it FS_RESERVE_BATCH blocks at a time */
+static struct resv_shard {
+    uint32_t cnt;
+} __attribute__((aligned(64))) resv_shards[FS_RESERVE_SHARDS];
+
+static __thread int resv_shard_id = -1;
+static int resv_next_id;
+
+/* Reservation counters, updated atomically */
+static struct {
+    uint64_t hits;    // reservations served from the thread's shard
+    uint64_t steals;  // served from another shard
+    uint64_t refills; // the shard was refilled under alloc_lock
+    uint64_t drains;  // all shards were given back to super.reserved
+} resv_stats;
+
+/* Data blocks allocated or freed since the last commit */
+static struct {
+    uint64_t *fresh; // allocated, no committed metadata points to them yet
+    uint64_t *freed; // freed, a crash gives them back to their old owner
+    uint32_t *list;  // every block with either bit set
+    uint32_t n;
+    uint32_t cap;
+    uint32_t nfreed; // blocks in freed
+} pending;
+
+/**
+ * @brief Remember that the on-disk bitmap block holding bit index changed
+ * @param mask imap_dirty or dmap_dirty of the group
+ * @param per_group bits of the bitmap in every group
+ */
+static void group_mark(uint32_t* mask, uint32_t index, uint32_t per_group)
+{
+    *mask |= 1u << ((index % per_group) / (super.params.size_block * 8));
+}
+
+/**
+ * @brief Pick a block group for a new directory
+ * @attention Directories under root are spread to the group with the most
+ *            free data blocks among those with at least the average number of
+ *            free inodes, deeper ones stay with their parent while it has room.
+ */
+static uint32_t group_pick_dir(struct fs_inode* parent)
+{
+    uint32_t parent_group = INO_GROUP(parent->ino);
+    uint32_t avg_inodes = super.imap->free / super.groups;
+    uint32_t avg_blocks = super.dmap->free / super.groups;
+
+    if (parent->self != super.root &&
+        super.gd[parent_group].free_inodes >= avg_inodes &&
+        super.gd[parent_group].free_blocks >= avg_blocks) {
+        return parent_group;
+    }
+
+    uint32_t best = parent_group;
+    for (uint32_t g = 0; g < super.groups; g++) {
+        if (super.gd[g].free_inodes == 0 || super.gd[g].free_inodes < avg_inodes) {
+            continue;
+        }
+        if (super.gd[g].free_blocks > super.gd[best].free_blocks) {
+            best = g;
+        }
+    }
+    return best;
+}
+
+/**
+ * @brief Allocate an inode number for a new file or directory under parent
+ * @attention Regular files go to the group of their parent, root is always
+ *            allocated from group 0.
+ */
+int ino_alloc(struct fs_inode* parent, FileType ftype)
+{
+    pthread_mutex_lock(&alloc_lock);
+    int ino = ERROR_IO;
+    if (maps_load() == ERROR_NONE) {
+        uint32_t group = 0;
+        if (parent != NULL) {
+            group = (ftype == FT_DIR) ? group_pick_dir(parent) : INO_GROUP(parent->ino);
+        }
+        ino = bitmap_find_zero(super.imap, group * super.ipg);
+        if (ino < 0) {
+            ino = ERROR_NOSPACE;
+        } else {
+            bitmap_set(super.imap, ino);
+            super.gd[INO_GROUP(ino)].free_inodes--;
+            group_mark(&super.gd[INO_GROUP(ino)].imap_dirty, ino, super.ipg);
+        }
+    }
+    pthread_mutex_unlock(&alloc_lock);
+    return ino;
+}
+
+/**
+ * @brief Free an inode number
+ * @return ERROR_IO if the bitmaps cannot be loaded, nothing is freed then
+ */
+int ino_free(uint32_t ino)
+{
+    pthread_mutex_lock(&alloc_lock);
+    int ret = maps_load();
+    if (ret == ERROR_NONE) {
+        if (super.itab != NULL) {
+            log_forget(ino);
+        }
+        if (bitmap_test(super.imap, ino)) {
+            bitmap_clear(super.imap, ino);
+            super.gd[INO_GROUP(ino)].free_inodes++;
+            group_mark(&super.gd[INO_GROUP(ino)].imap_dirty, ino, super.ipg);
+        }
+    }
+    pthread_mutex_unlock(&alloc_lock);
+    return ret;
+}
+
+/**
+ * @brief Default goal for the first data block of inode, start of its group
+ */
+uint32_t dno_goal(struct fs_inode* inode)
+{
+    return INO_GROUP(inode->ino) * super.dpg;
+}
+
+/**
+ * @brief Remember that dno changed state in the running transaction
+ */
+static void pending_mark(uint64_t** bits, uint32_t dno)
+{
+    if (pending.fresh == NULL) {
+        pending.fresh = (uint64_t*)calloc(super.params.max_dno / 64 + 1, sizeof(uint64_t));
+        pending.freed = (uint64_t*)calloc(super.params.max_dno / 64 + 1, sizeof(uint64_t));
+    }
+    if (pending.n == pending.cap) {
+        pending.cap = pending.cap ? pending.cap * 2 : 64;
+        pending.list = (uint32_t*)realloc(pending.list, pending.cap * sizeof(uint32_t));
+    }
+    (*bits)[dno / 64] |= (uint64_t)1 << (dno % 64);
+    pending.list[pending.n++] = dno;
+}
+
+static int pending_test(const uint64_t* bits, uint32_t dno)
+{
+    return bits != NULL && ((bits[dno / 64] >> (dno % 64)) & 1);
+}
+
+/**
+ * @brief Blocks held back from file data, the log needs them to keep moving
+ */
+static uint32_t dno_held()
+{
+    return super.reserved + (super.log_segment != 0 ? FS_LOG_RESERVE : 0);
+}
+
+/**
+ * @brief Take cnt blocks out of a shard if it holds that many
+ */
+static int resv_take(struct resv_shard* shard, uint32_t cnt)
+{
+    uint32_t have = __atomic_load_n(&shard->cnt, __ATOMIC_RELAXED);
+    while (have >= cnt) {
+        if (__atomic_compare_exchange_n(&shard->cnt, &have, have - cnt, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Give the blocks cached in every shard back to super.reserved
+ * @attention Caller holds alloc_lock
+ */
+static void resv_drain()
+{
+    uint32_t total = 0;
+    for (int i = 0; i < FS_RESERVE_SHARDS; i++) {
+        total += __atomic_exchange_n(&resv_shards[i].cnt, 0, __ATOMIC_RELAXED);
+    }
+    if (total != 0) {
+        super.reserved -= total;
+        __atomic_add_fetch(&resv_stats.drains, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * @brief Whether cnt more blocks can be held back from allocation, giving
+ *        the shards back first if they are what stands in the way
+ * @attention Caller holds alloc_lock and the maps are loaded
+ */
+static int resv_room(uint32_t cnt)
+{
+    if (super.dmap->free >= dno_held() + cnt) {
+        return 1;
+    }
+    resv_drain();
+    return super.dmap->free >= dno_held() + cnt;
+}
+
+/**
+ * @brief Set in the data bitmap every block freed by the running transaction,
+ *        or clear them again, so that a search around it skips them
+ * @attention Caller holds alloc_lock
+ */
+static void pending_hide(int hide)
+{
+    for (uint32_t i = 0; pending.nfreed != 0 && i < pending.n; i++) {
+        uint32_t dno = pending.list[i];
+        if (!pending_test(pending.freed, dno)) {
+            continue;
+        }
+        if (hide) {
+            bitmap_set(super.dmap, dno);
+        } else {
+            bitmap_clear(super.dmap, dno);
+        }
+    }
+}
+
+/**
+ * @brief Take a run of free data blocks, from the log head in log-structured mode
+ * @attention Blocks freed since the last commit are never taken: after a
+ *            crash the committed metadata still points to them
+ */
+static int dno_take(uint32_t goal, uint32_t want, uint32_t min, uint32_t* len)
+{
+    int dno;
+    pending_hide(1);
+    if (super.log_segment != 0) {
+        dno = log_alloc(want, min, len);
+    } else {
+        dno = bitmap_alloc_range(super.dmap, goal, want, min, len);
+    }
+    pending_hide(0);
+    if (dno < 0) {
+        return ERROR_NOSPACE;
+    }
+    for (uint32_t i = dno; i < dno + *len; i++) {
+        super.gd[DNO_GROUP(i)].free_blocks--;
+        group_mark(&super.gd[DNO_GROUP(i)].dmap_dirty, i, super.dpg);
+        pending_mark(&pending.fresh, i);
+    }
+    return dno;
+}
+
+/**
+ * @brief Allocate a run of data blocks near goal, see bitmap_alloc_range
+ */
+int dno_alloc(uint32_t goal, uint32_t want, uint32_t min, uint32_t* len)
+{
+    pthread_mutex_lock(&alloc_lock);
+    int dno = ERROR_IO;
+    if (maps_load() == ERROR_NONE) {
+        dno = resv_room(min) ? dno_take(goal, want, min, len) : ERROR_NOSPACE;
+    }
+    pthread_mutex_unlock(&alloc_lock);
+    return dno;
+}
+
+/**
+ * @brief Allocate blocks for metadata, which may use the blocks held back
+ *        for the log in log-structured mode
+ */
+int dno_alloc_meta(uint32_t goal, uint32_t want, uint32_t* len)
+{
+    pthread_mutex_lock(&alloc_lock);
+    int dno = ERROR_IO;
+    if (maps_load() == ERROR_NONE) {
+        if (super.dmap->free < super.reserved + 1) {
+            resv_drain();
+        }
+        dno = super.dmap->free < super.reserved + 1 ? ERROR_NOSPACE : dno_take(goal, want, 1, len);
+    }
+    pthread_mutex_unlock(&alloc_lock);
+    return dno;
+}
+
+/**
+ * @brief Promise cnt data blocks to delayed allocation without picking them
+ * @attention Served from the thread's shard, then from the others, without
+ *            alloc_lock; only refilling a shard takes it. Near a full disk
+ *            the shards are given back and blocks are reserved one by one
+ */
+int dno_reserve(uint32_t cnt)
+{
+    if (cnt == 0) {
+        return ERROR_NONE;
+    }
+    if (resv_shard_id < 0) {
+        resv_shard_id = __atomic_fetch_add(&resv_next_id, 1, __ATOMIC_RELAXED) % FS_RESERVE_SHARDS;
+    }
+    if (resv_take(&resv_shards[resv_shard_id], cnt)) {
+        __atomic_add_fetch(&resv_stats.hits, 1, __ATOMIC_RELAXED);
+        return ERROR_NONE;
+    }
+    for (int i = 1; i < FS_RESERVE_SHARDS; i++) {
+        if (resv_take(&resv_shards[(resv_shard_id + i) % FS_RESERVE_SHARDS], cnt)) {
+            __atomic_add_fetch(&resv_stats.steals, 1, __ATOMIC_RELAXED);
+            return ERROR_NONE;
+        }
+    }
+
+    pthread_mutex_lock(&alloc_lock);
+    int ret = ERROR_IO;
+    if (maps_load() == ERROR_NONE) {
+        ret = ERROR_NOSPACE;
+        if (super.dmap->free >= dno_held() + cnt + FS_RESERVE_BATCH) {
+            super.reserved += cnt + FS_RESERVE_BATCH;
+            __atomic_add_fetch(&resv_shards[resv_shard_id].cnt, FS_RESERVE_BATCH, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&resv_stats.refills, 1, __ATOMIC_RELAXED);
+            ret = ERROR_NONE;
+        } else if (resv_room(cnt)) {
+            super.reserved += cnt;
+            ret = ERROR_NONE;
+        }
+    }
+    pthread_mutex_unlock(&alloc_lock);
+    return ret;
+}
+
+/**
+ * @brief Give back blocks promised by dno_reserve
+ * @attention They go straight back to super.reserved, so the allocation
+ *            that usually follows finds them. Writeback gives back the
+ *            blocks of a whole file at once
+ */
+void dno_unreserve(uint32_t cnt)
+{
+    pthread_mutex_lock(&alloc_lock);
+    super.reserved -= cnt;
+    pthread_mutex_unlock(&alloc_lock);
+}
+
+/**
+ * @brief Hold cnt blocks given up by dno_unreserve back again
+ * @attention Never fails: the pages they were reserved for found no block
+ *            at writeback and stay dirty. Any overcommit makes new
+ *            reservations fail until blocks are freed
+ */
+void dno_rereserve(uint32_t cnt)
+{
+    pthread_mutex_lock(&alloc_lock);
+    super.reserved += cnt;
+    pthread_mutex_unlock(&alloc_lock);
+}
+
+/**
+ * @brief Give the blocks cached in the reservation shards back, so that
+ *        super.reserved counts only blocks promised to pages
+ */
+void dno_drain()
+{
+    pthread_mutex_lock(&alloc_lock);
+    resv_drain();
+    pthread_mutex_unlock(&alloc_lock);
+}
+
+/**
+ * @brief Print how reservations were served
+ */
+void dno_stats()
+{
+    fprintf(stderr, "reserve : hits %llu, steals %llu, refills %llu, drains %llu\n",
+            (unsigned long long)resv_stats.hits, (unsigned long long)resv_stats.steals,
+            (unsigned long long)resv_stats.refills, (unsigned long long)resv_stats.drains);
+}
+
+/**
+ * @brief Free a run of data blocks
+ * @attention Blocks shared with a snapshot are handed over to it and stay
+ *            allocated
+ * @return ERROR_IO if the bitmaps cannot be loaded, nothing is freed then
+ */
+int dno_free(uint32_t dno, uint32_t len)
+{
+    pthread_mutex_lock(&alloc_lock);
+    int ret = maps_load();
+    for (uint32_t i = dno; ret == ERROR_NONE && i < dno + len; i++) {
+        if (bitmap_test(super.dmap, i)) {
+            if (snap_free(i)) {
+                continue;
+            }
+            if (pending_test(pending.fresh, i)) {
+                pending.fresh[i / 64] &= ~((uint64_t)1 << (i % 64)); // * Never committed, free for good
+            } else {
+                pending_mark(&pending.freed, i);
+                pending.nfreed++;
+            }
+            bitmap_clear(super.dmap, i);
+            super.gd[DNO_GROUP(i)].free_blocks++;
+            group_mark(&super.gd[DNO_GROUP(i)].dmap_dirty, i, super.dpg);
+        }
+    }
+    pthread_mutex_unlock(&alloc_lock);
+    return ret;
+}
+
+/**
+ * @brief Mark one data block in use if the bitmap lost it
+ * @return ERROR_IO if the bitmaps cannot be loaded
+ */
+int dno_claim(uint32_t dno)
+{
+    pthread_mutex_lock(&alloc_lock);
+    int ret = maps_load();
+    if (ret == ERROR_NONE && !bitmap_test(super.dmap, dno)) {
+        bitmap_set(super.dmap, dno);
+        super.gd[DNO_GROUP(dno)].free_blocks--;
+        group_mark(&super.gd[DNO_GROUP(dno)].dmap_dirty, dno, super.dpg);
+    }
+    pthread_mutex_unlock(&alloc_lock);
+    return ret;
+}
+
+/**
+ * @brief Whether dno was allocated by the running transaction, so nothing
+ *        committed refers to it and it may be rewritten in place
+ */
+int dno_fresh(uint32_t dno)
+{
+    return pending_test(pending.fresh, dno);
+}
+
+/**
+ * @brief Whether dno was freed by the running transaction
+ * @attention Such blocks must not be reused before the commit: after a
+ *            crash the committed metadata still points to them
+ */
+int dno_freed(uint32_t dno)
+{
+    return pending_test(pending.freed, dno);
+}
+
+/**
+ * @brief Number of blocks freed by the running transaction, held back
+ *        from allocation until it commits
+ */
+uint32_t dno_freed_count()
+{
+    pthread_mutex_lock(&alloc_lock);
+    uint32_t n = pending.nfreed;
+    pthread_mutex_unlock(&alloc_lock);
+    return n;
+}
+
+/**
+ * @brief The running transaction is committed, its blocks are ordinary again
+ */
+void dno_commit()
+{
+    pthread_mutex_lock(&alloc_lock);
+    for (uint32_t i = 0; i < pending.n; i++) {
+        uint32_t dno = pending.list[i];
+        pending.fresh[dno / 64] &= ~((uint64_t)1 << (dno % 64));
+        pending.freed[dno / 64] &= ~((uint64_t)1 << (dno % 64));
+    }
+    pending.n = 0;
+    pending.nfreed = 0;
+    pthread_mutex_unlock(&alloc_lock);
+}
+
+/**
+ * @brief Release the pending sets and reset the counters at umount
+ */
+void dno_pending_free()
+{
+    free(pending.fresh);
+    free(pending.freed);
+    free(pending.list);
+    memset(&pending, 0, sizeof(pending));
+    memset(&resv_stats, 0, sizeof(resv_stats));
+}
+
+/**
+ * @brief Recompute per-group free counts from the bitmaps
+ */
+void group_rebuild()
+{
+    for (uint32_t g = 0; g < super.groups; g++) {
+        super.gd[g].free_inodes = bitmap_count_zero(super.imap, g * super.ipg, (g + 1) * super.ipg);
+        super.gd[g].free_blocks = bitmap_count_zero(super.dmap, g * super.dpg, (g + 1) * super.dpg);
+    }
+}
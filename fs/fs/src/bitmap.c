@@ -1,69 +1,455 @@
 #include "../include/fs.h"
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
+#define WORD_BITS 64
+#define WORD_FULL (~(uint64_t)0)
+#define GROUP_WORDS (BITMAP_GROUP_BITS / WORD_BITS)
+#define RANGE_GROUPS 8 // groups searched for a longer run once one of min bits is found
 
 /**
- * @brief Create a bitmap with given size and initialize it to 0.
+ * @brief Create a bitmap with given size (in bits) and initialize it to 0.
  */
-uint8_t *bitmap_init(uint32_t size) {
-    uint32_t bitmap_size = (size + 7) / 8;
-    uint8_t *bitmap = (uint8_t *)malloc(bitmap_size);
+struct bitmap *bitmap_init(uint32_t size) {
+    struct bitmap *bitmap = (struct bitmap *)calloc(1, sizeof(struct bitmap));
     if (bitmap == NULL) {
-        return ERROR_NOSPACE;
+        return NULL;
     }
-    memset(bitmap, 0, bitmap_size);
+    bitmap->size = size;
+    bitmap->nwords = (size + WORD_BITS - 1) / WORD_BITS;
+    bitmap->words = (uint64_t *)calloc(bitmap->nwords + 1, sizeof(uint64_t));
+
+    // Summary levels, each with one bit per entry of the level below
+    uint32_t entries = bitmap->nwords;
+    do {
+        uint32_t nwords = (entries + WORD_BITS - 1) / WORD_BITS;
+        bitmap->levels[bitmap->nlevels] = (uint64_t *)calloc(nwords, sizeof(uint64_t));
+        bitmap->level_bits[bitmap->nlevels] = entries;
+        bitmap->nlevels++;
+        entries = nwords;
+    } while (entries > 1 && bitmap->nlevels < BITMAP_MAX_LEVELS);
+
+    bitmap->ngroups = (size + BITMAP_GROUP_BITS - 1) / BITMAP_GROUP_BITS;
+    bitmap->group_free = (uint16_t *)calloc(bitmap->ngroups + 1, sizeof(uint16_t));
+    bitmap->group_run = (uint16_t *)calloc(bitmap->ngroups + 1, sizeof(uint16_t));
+
+    bitmap_rebuild(bitmap);
     return bitmap;
 }
 
+/**
+ * @brief Release a bitmap created by bitmap_init.
+ */
+void bitmap_free(struct bitmap *bitmap) {
+    for (int l = 0; l < bitmap->nlevels; l++) {
+        free(bitmap->levels[l]);
+    }
+    free(bitmap->group_free);
+    free(bitmap->group_run);
+    free(bitmap->words);
+    free(bitmap);
+}
+
+/**
+ * @brief Recompute summary levels and free counts from bitmap->words.
+ * @attention Call after loading words from disk.
+ */
+void bitmap_rebuild(struct bitmap *bitmap) {
+    bitmap->free = 0;
+    for (uint32_t g = 0; g < bitmap->ngroups; g++) {
+        uint32_t start = g * BITMAP_GROUP_BITS;
+        uint32_t end = start + BITMAP_GROUP_BITS < bitmap->size ? start + BITMAP_GROUP_BITS : bitmap->size;
+        uint32_t used = 0;
+        for (uint32_t i = start / WORD_BITS; i * WORD_BITS < end; i++) {
+            uint64_t word = bitmap->words[i];
+            if ((i + 1) * WORD_BITS > end) {
+                word &= ((uint64_t)1 << (end % WORD_BITS)) - 1;
+            }
+            used += __builtin_popcountll(word);
+        }
+        bitmap->group_free[g] = end - start - used;
+        bitmap->group_run[g] = end - start - used; // * Tightened by bitmap_alloc_range
+        bitmap->free += end - start - used;
+    }
+
+    // Entries past level_bits count as full, so every level can fill up
+    const uint64_t *below = bitmap->words;
+    for (int l = 0; l < bitmap->nlevels; l++) {
+        uint32_t entries = bitmap->level_bits[l];
+        uint32_t nwords = (entries + WORD_BITS - 1) / WORD_BITS;
+        for (uint32_t q = 0; q < nwords; q++) {
+            uint64_t word = 0;
+            for (uint32_t j = 0; j < WORD_BITS; j++) {
+                uint32_t e = q * WORD_BITS + j;
+                if (e >= entries || below[e] == WORD_FULL) {
+                    word |= (uint64_t)1 << j;
+                }
+            }
+            bitmap->levels[l][q] = word;
+        }
+        below = bitmap->levels[l];
+    }
+}
+
+/**
+ * @brief Record that entry idx of the level below level became full or not.
+ */
+static void bitmap_mark(struct bitmap *bitmap, int level, uint32_t idx, int full) {
+    uint64_t *word = &bitmap->levels[level][idx / WORD_BITS];
+    uint64_t bit = (uint64_t)1 << (idx % WORD_BITS);
+    int was_full = (*word == WORD_FULL);
+
+    if (full) {
+        *word |= bit;
+    } else {
+        *word &= ~bit;
+    }
+    if (level + 1 < bitmap->nlevels && was_full != (*word == WORD_FULL)) {
+        bitmap_mark(bitmap, level + 1, idx / WORD_BITS, !was_full);
+    }
+}
+
+/**
+ * @brief Number of bytes the bitmap occupies on disk.
+ * @attention Bit i is stored in byte i / 8, which matches the word layout
+ *            on little-endian hosts, so bitmap->words is read and written as is.
+ */
+uint32_t bitmap_bytes(struct bitmap *bitmap) {
+    return (bitmap->size + 7) / 8;
+}
+
 /**
  * @brief Set the bit at given index to 1.
  * @attention Caller should ensure index is valid.
  */
-void bitmap_set(uint8_t *bitmap, uint32_t index) {
-    uint32_t byte_index = index / 8;
-    uint32_t bit_index = index % 8;
-    bitmap[byte_index] |= (1 << bit_index);
+void bitmap_set(struct bitmap *bitmap, uint32_t index) {
+    uint64_t *word = &bitmap->words[index / WORD_BITS];
+    uint64_t bit = (uint64_t)1 << (index % WORD_BITS);
+    if (*word & bit) {
+        return;
+    }
+    *word |= bit;
+    bitmap->free--;
+    uint32_t g = index / BITMAP_GROUP_BITS;
+    bitmap->group_free[g]--;
+    if (bitmap->group_run[g] > bitmap->group_free[g]) {
+        bitmap->group_run[g] = bitmap->group_free[g];
+    }
+    if (*word == WORD_FULL) {
+        bitmap_mark(bitmap, 0, index / WORD_BITS, 1);
+    }
 }
 
 /**
  * @brief Set the bit at given index to 0.
  * @attention Caller should ensure index is valid.
  */
-void bitmap_clear(uint8_t *bitmap, uint32_t index) {
-    uint32_t byte_index = index / 8;
-    uint32_t bit_index = index % 8;
-    bitmap[byte_index] &= ~(1 << bit_index);
+void bitmap_clear(struct bitmap *bitmap, uint32_t index) {
+    uint64_t *word = &bitmap->words[index / WORD_BITS];
+    uint64_t bit = (uint64_t)1 << (index % WORD_BITS);
+    if (!(*word & bit)) {
+        return;
+    }
+    if (*word == WORD_FULL) {
+        bitmap_mark(bitmap, 0, index / WORD_BITS, 0);
+    }
+    *word &= ~bit;
+    bitmap->free++;
+    uint32_t g = index / BITMAP_GROUP_BITS;
+    bitmap->group_free[g]++;
+    // At worst the bit joins two of the longest runs
+    uint32_t run = 2 * bitmap->group_run[g] + 1;
+    bitmap->group_run[g] = run < bitmap->group_free[g] ? run : bitmap->group_free[g];
+}
+
+/**
+ * @brief Set bits [start, start + len) to 1.
+ */
+void bitmap_set_range(struct bitmap *bitmap, uint32_t start, uint32_t len) {
+    for (uint32_t i = start; i < start + len; i++) {
+        bitmap_set(bitmap, i);
+    }
+}
+
+/**
+ * @brief Set bits [start, start + len) to 0.
+ */
+void bitmap_clear_range(struct bitmap *bitmap, uint32_t start, uint32_t len) {
+    for (uint32_t i = start; i < start + len; i++) {
+        bitmap_clear(bitmap, i);
+    }
 }
 
 /**
- * @brief Find the first zero bit slower than size in the bitmap.
+ * @brief Count zero bits in [start, end).
  */
-int bitmap_find_first_zero(uint8_t *bitmap, uint32_t size) {
-    int ret = -1;
-    uint32_t bitmap_size = (size + 7) / 8;
-    for (uint32_t i = 0; i < bitmap_size; i++) {
-        if (bitmap[i] == 0xFF)
+uint32_t bitmap_count_zero(struct bitmap *bitmap, uint32_t start, uint32_t end) {
+    if (end > bitmap->size) {
+        end = bitmap->size;
+    }
+    uint32_t used = 0;
+    for (uint32_t i = start; i < end; ) {
+        // Whole groups are counted from their free count
+        if (i % BITMAP_GROUP_BITS == 0 && end - i >= BITMAP_GROUP_BITS) {
+            used += BITMAP_GROUP_BITS - bitmap->group_free[i / BITMAP_GROUP_BITS];
+            i += BITMAP_GROUP_BITS;
             continue;
-        for (uint32_t j = 0; j < 8; j++) {
-            if ((bitmap[i] & (1 << j)) == 0) {
-                ret = i * 8 + j;
-                if (ret >= size) {
-                    return ERROR_NOSPACE;
-                }
-                return ret;
+        }
+        uint64_t word = bitmap->words[i / WORD_BITS] >> (i % WORD_BITS);
+        uint32_t bits = WORD_BITS - i % WORD_BITS;
+        if (bits > end - i) {
+            bits = end - i;
+            word &= ((uint64_t)1 << bits) - 1;
+        }
+        used += __builtin_popcountll(word);
+        i += bits;
+    }
+    return end > start ? end - start - used : 0;
+}
+
+/**
+ * @brief Test the bit at given index.
+ */
+int bitmap_test(struct bitmap *bitmap, uint32_t index) {
+    return (bitmap->words[index / WORD_BITS] >> (index % WORD_BITS)) & 1;
+}
+
+#if defined(__x86_64__)
+/**
+ * @brief Skip full words from words[i], 4 words per step.
+ */
+__attribute__((target("avx2")))
+static uint32_t bitmap_skip_full_avx2(const uint64_t *words, uint32_t i, uint32_t n) {
+    const __m256i full = _mm256_set1_epi64x(-1);
+    for (; i + 4 <= n; i += 4) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(words + i));
+        if (!_mm256_testc_si256(v, full)) {
+            break;
+        }
+    }
+    return i;
+}
+
+/**
+ * @brief Skip full words from words[i], 2 words per step.
+ */
+static uint32_t bitmap_skip_full_sse2(const uint64_t *words, uint32_t i, uint32_t n) {
+    const __m128i full = _mm_set1_epi32(-1);
+    for (; i + 2 <= n; i += 2) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(words + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, full)) != 0xFFFF) {
+            break;
+        }
+    }
+    return i;
+}
+#endif
+
+/**
+ * @brief Return the index of the first word at or after i that is not full.
+ */
+static uint32_t bitmap_skip_full(const uint64_t *words, uint32_t i, uint32_t n) {
+#if defined(__x86_64__)
+    static int has_avx2 = -1;
+    if (has_avx2 < 0) {
+        has_avx2 = __builtin_cpu_supports("avx2");
+    }
+    i = has_avx2 ? bitmap_skip_full_avx2(words, i, n) : bitmap_skip_full_sse2(words, i, n);
+#endif
+    while (i < n && words[i] == WORD_FULL) {
+        i++;
+    }
+    return i;
+}
+
+/**
+ * @brief Find the first entry at or after idx that is not full, by its bit in
+ *        summary level, descending from the levels above.
+ * @return entry index, or -1 if every entry from idx on is full
+ */
+static int64_t bitmap_next_nonfull(struct bitmap *bitmap, int level, uint32_t idx) {
+    if (idx >= bitmap->level_bits[level]) {
+        return -1;
+    }
+    const uint64_t *words = bitmap->levels[level];
+    uint32_t q = idx / WORD_BITS;
+    uint64_t word = words[q] | (((uint64_t)1 << (idx % WORD_BITS)) - 1);
+    if (word != WORD_FULL) {
+        return (int64_t)q * WORD_BITS + __builtin_ctzll(~word);
+    }
+
+    int64_t next;
+    if (level + 1 < bitmap->nlevels) {
+        next = bitmap_next_nonfull(bitmap, level + 1, q + 1);
+    } else {
+        // Top level is a handful of words, scan it
+        uint32_t nwords = (bitmap->level_bits[level] + WORD_BITS - 1) / WORD_BITS;
+        next = bitmap_skip_full(words, q + 1, nwords);
+        next = next < nwords ? next : -1;
+    }
+    if (next < 0) {
+        return -1;
+    }
+    return next * WORD_BITS + __builtin_ctzll(~words[next]);
+}
+
+/**
+ * @brief Find the first zero bit in [start, end).
+ */
+static int bitmap_find_zero_in(struct bitmap *bitmap, uint32_t start, uint32_t end) {
+    if (start >= end) {
+        return ERROR_NOSPACE;
+    }
+    uint32_t i = start / WORD_BITS;
+
+    // Bits below start in the first word count as used
+    uint64_t word = bitmap->words[i] | (((uint64_t)1 << (start % WORD_BITS)) - 1);
+    if (word == WORD_FULL) {
+        int64_t next = bitmap_next_nonfull(bitmap, 0, i + 1);
+        if (next < 0) {
+            return ERROR_NOSPACE;
+        }
+        i = next;
+        word = bitmap->words[i];
+    }
+    uint32_t index = i * WORD_BITS + __builtin_ctzll(~word);
+    return index < end ? (int)index : ERROR_NOSPACE;
+}
+
+/**
+ * @brief Find the first one bit in [start, end), return end if none.
+ * @attention Groups with no bit set are stepped over by their free count.
+ */
+static uint32_t bitmap_find_one_in(struct bitmap *bitmap, uint32_t start, uint32_t end) {
+    uint32_t i = start / WORD_BITS;
+    uint32_t n = (end + WORD_BITS - 1) / WORD_BITS;
+
+    // Bits below start in the first word count as free
+    uint64_t word = bitmap->words[i] & ~(((uint64_t)1 << (start % WORD_BITS)) - 1);
+    while (word == 0) {
+        if (++i >= n) {
+            return end;
+        }
+        while (i % GROUP_WORDS == 0 && bitmap->group_free[i / GROUP_WORDS] == BITMAP_GROUP_BITS) {
+            i += GROUP_WORDS;
+            if (i >= n) {
+                return end;
             }
         }
+        word = bitmap->words[i];
+    }
+    uint32_t index = i * WORD_BITS + __builtin_ctzll(word);
+    return index < end ? index : end;
+}
+
+/**
+ * @brief Find the first zero bit at or after start, wrapping around to 0.
+ */
+int bitmap_find_zero(struct bitmap *bitmap, uint32_t start) {
+    if (start >= bitmap->size) {
+        start = 0;
     }
-    return ERROR_NOSPACE;
+    int index = bitmap_find_zero_in(bitmap, start, bitmap->size);
+    if (index == ERROR_NOSPACE) {
+        index = bitmap_find_zero_in(bitmap, 0, start);
+    }
+    return index;
 }
 
 /**
- * @brief Allocate a free block in the bitmap, set it to 1 and return its index.
+ * @brief Allocate a free bit in the bitmap, set it to 1 and return its index.
+ * @attention Search starts from the next-fit cursor, so sequential
+ *            allocations do not rescan the used prefix.
  */
-int bitmap_alloc(uint8_t *bitmap, uint32_t size) {
-    int index = bitmap_find_first_zero(bitmap, size);
+int bitmap_alloc(struct bitmap *bitmap) {
+    int index = bitmap_find_zero(bitmap, bitmap->hint);
     if (index == ERROR_NOSPACE) {
         return ERROR_NOSPACE;
     }
     bitmap_set(bitmap, index);
+    bitmap->hint = index + 1;
     return index;
-}
\ No newline at end of file
+}
+
+/**
+ * @brief Allocate a run of free bits near goal.
+ * @param goal where the search starts, wrapping around to 0
+ * @param want preferred run length, the first run this long is taken
+ * @param min shortest acceptable run length
+ * @param len returns the allocated run length, between min and want
+ * @return start of the run, or ERROR_NOSPACE if no run of min bits is free
+ * @attention Without a run of want bits, the longest run found is taken;
+ *            once a run of min bits is found only RANGE_GROUPS more groups
+ *            are searched. A group whose group_run is no longer than the
+ *            best run so far can only hold the head of a longer run that
+ *            spills into the next group, so the scan jumps to its last
+ *            group_run bits. A group scanned whole gets its exact longest
+ *            run recorded in group_run.
+ */
+int bitmap_alloc_range(struct bitmap *bitmap, uint32_t goal, uint32_t want, uint32_t min,
+                       uint32_t *len) {
+    if (bitmap->free < min) {
+        return ERROR_NOSPACE;
+    }
+    if (goal >= bitmap->size) {
+        goal = 0;
+    }
+    int best = ERROR_NOSPACE;
+    uint32_t best_len = 0;
+    uint32_t visited = 0; // groups entered since best_len reached min
+
+    // Runs starting in [goal, size) and then in [0, goal), each measured
+    // whole, so a run crossing goal is seen by the second pass
+    uint32_t ranges[2][2] = { { goal, bitmap->size }, { 0, goal } };
+    for (int r = 0; r < 2 && best_len < want; r++) {
+        uint32_t pos = ranges[r][0];
+        uint32_t end = ranges[r][1];
+        while (pos < end && best_len < want) {
+            if (best_len >= min && ++visited > RANGE_GROUPS) {
+                r = 2;
+                break;
+            }
+            uint32_t g = pos / BITMAP_GROUP_BITS;
+            uint32_t group_start = g * BITMAP_GROUP_BITS;
+            uint32_t group_end = group_start + BITMAP_GROUP_BITS < bitmap->size ?
+                                 group_start + BITMAP_GROUP_BITS : bitmap->size;
+            if (bitmap->group_run[g] <= best_len) {
+                uint32_t tail = group_end - bitmap->group_run[g];
+                pos = tail > pos ? tail : pos;
+            }
+            uint32_t from = pos;
+            uint32_t stop_at = group_end < end ? group_end : end;
+            uint32_t longest = 0;
+            while (pos < stop_at) {
+                int start = bitmap_find_zero_in(bitmap, pos, stop_at);
+                if (start == ERROR_NOSPACE) {
+                    pos = stop_at;
+                    break;
+                }
+                uint32_t stop = bitmap_find_one_in(bitmap, start, bitmap->size);
+                uint32_t inside = (stop < group_end ? stop : group_end) - start;
+                longest = inside > longest ? inside : longest;
+                pos = stop;
+                if (stop - start > best_len) {
+                    best = start;
+                    best_len = stop - start;
+                    if (best_len >= want) {
+                        break;
+                    }
+                }
+            }
+            if (from == group_start && stop_at == group_end && best_len < want) {
+                bitmap->group_run[g] = longest;
+            }
+        }
+    }
+    if (best == ERROR_NOSPACE || best_len < min) {
+        return ERROR_NOSPACE;
+    }
+
+    *len = best_len < want ? best_len : want;
+    bitmap_set_range(bitmap, best, *len);
+    bitmap->hint = best + *len;
+    return best;
+}
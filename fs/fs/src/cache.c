@@ -0,0 +1,300 @@
+#include "../include/fs.h"
+
+extern struct fs_super super;
+extern struct custom_options fs_options;
+extern struct slab_pool dentry_pool;
+extern struct slab_pool inode_pool;
+
+/* Protects the LRU and dirty lists, lookups under the shared fs lock touch them */
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* LRU list of resident inodes, head is the most recently used */
+static struct fs_inode lru = { .lru_prev = &lru, .lru_next = &lru };
+
+/* Inodes whose record or data pages still have to be written back */
+static struct fs_inode dirty_list = { .dirty_prev = &dirty_list, .dirty_next = &dirty_list };
+static uint32_t ndirty; // length of dirty_list
+
+/**
+ * @brief Bytes of In-Memory dentries and inodes
+ */
+size_t cache_usage() {
+    return (size_t)__atomic_load_n(&dentry_pool.live, __ATOMIC_RELAXED) * dentry_pool.obj_size +
+           (size_t)__atomic_load_n(&inode_pool.live, __ATOMIC_RELAXED) * inode_pool.obj_size;
+}
+
+/**
+ * @brief Whether usage exceeds the budget given by --cache
+ */
+int cache_over() {
+    return cache_usage() > (size_t)fs_options.cache_size * 1024;
+}
+
+static void lru_unlink(struct fs_inode *inode) {
+    inode->lru_prev->lru_next = inode->lru_next;
+    inode->lru_next->lru_prev = inode->lru_prev;
+    inode->lru_prev = NULL;
+    inode->lru_next = NULL;
+}
+
+static void dirty_unlink(struct fs_inode *inode) {
+    inode->dirty_prev->dirty_next = inode->dirty_next;
+    inode->dirty_next->dirty_prev = inode->dirty_prev;
+    inode->dirty_prev = NULL;
+    inode->dirty_next = NULL;
+    ndirty--;
+}
+
+/**
+ * @brief Move inode to the head of LRU list, insert it if not cached yet
+ */
+void cache_touch(struct fs_inode *inode) {
+    pthread_mutex_lock(&cache_lock);
+    if (inode->lru_next != NULL) {
+        lru_unlink(inode);
+    }
+    inode->lru_next = lru.lru_next;
+    inode->lru_prev = &lru;
+    lru.lru_next->lru_prev = inode;
+    lru.lru_next = inode;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/**
+ * @brief Remove inode from LRU list
+ */
+void cache_remove(struct fs_inode *inode) {
+    pthread_mutex_lock(&cache_lock);
+    if (inode->lru_next != NULL) {
+        lru_unlink(inode);
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/**
+ * @brief Mark the record of inode stale and queue it for writeback
+ */
+void cache_mark_dirty(struct fs_inode *inode) {
+    pthread_mutex_lock(&cache_lock);
+    inode->dirty = 1;
+    inode->dirty_gen++;
+    if (inode->dirty_next == NULL) {
+        inode->dirtied = time(NULL);
+        inode->dirty_next = &dirty_list;
+        inode->dirty_prev = dirty_list.dirty_prev;
+        dirty_list.dirty_prev->dirty_next = inode;
+        dirty_list.dirty_prev = inode;
+        ndirty++;
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/**
+ * @brief Mark inode written back and take it off the dirty list
+ */
+void cache_mark_clean(struct fs_inode *inode) {
+    pthread_mutex_lock(&cache_lock);
+    inode->dirty = 0;
+    if (inode->dirty_next != NULL) {
+        dirty_unlink(inode);
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/**
+ * @brief Mark inode written back as of generation gen, see cache_dirty_gen
+ * @attention If it was dirtied again since, it stays dirty and queued for
+ *            the next sync, fsync writes back beside writers
+ */
+void cache_mark_synced(struct fs_inode *inode, uint32_t gen) {
+    pthread_mutex_lock(&cache_lock);
+    if (inode->dirty_gen == gen) {
+        inode->dirty = 0;
+        if (inode->dirty_next != NULL) {
+            dirty_unlink(inode);
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/**
+ * @brief Generation of the dirty state of inode, bumped by cache_mark_dirty
+ */
+uint32_t cache_dirty_gen(struct fs_inode *inode) {
+    pthread_mutex_lock(&cache_lock);
+    uint32_t gen = inode->dirty_gen;
+    pthread_mutex_unlock(&cache_lock);
+    return gen;
+}
+
+/**
+ * @brief Whether the record of inode is stale
+ */
+int cache_is_dirty(struct fs_inode *inode) {
+    pthread_mutex_lock(&cache_lock);
+    int dirty = inode->dirty;
+    pthread_mutex_unlock(&cache_lock);
+    return dirty;
+}
+
+/**
+ * @brief Take the oldest inode off the dirty list, its dirty flag is kept
+ * @return NULL if nothing is dirty
+ */
+struct fs_inode *cache_dirty_pop() {
+    pthread_mutex_lock(&cache_lock);
+    struct fs_inode *inode = dirty_list.dirty_next;
+    if (inode == &dirty_list) {
+        inode = NULL;
+    } else {
+        dirty_unlink(inode);
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return inode;
+}
+
+/**
+ * @brief Number of inodes on the dirty list
+ */
+uint32_t cache_dirty_count() {
+    pthread_mutex_lock(&cache_lock);
+    uint32_t n = ndirty;
+    pthread_mutex_unlock(&cache_lock);
+    return n;
+}
+
+/**
+ * @brief When the oldest dirty inode was dirtied
+ * @return 0 if nothing is dirty
+ */
+time_t cache_dirty_since() {
+    pthread_mutex_lock(&cache_lock);
+    time_t since = dirty_list.dirty_next == &dirty_list ? 0 : dirty_list.dirty_next->dirtied;
+    pthread_mutex_unlock(&cache_lock);
+    return since;
+}
+
+/**
+ * @brief Call fn on every resident inode
+ * @attention fn must not add inodes to the cache or evict them.
+ *            Caller holds the fs lock exclusively
+ */
+void cache_walk(void (*fn)(struct fs_inode *inode, void *arg), void *arg) {
+    for (struct fs_inode *inode = lru.lru_next; inode != &lru; inode = inode->lru_next) {
+        fn(inode, arg);
+    }
+}
+
+/**
+ * @brief Forget all cached inodes, used when the In-Memory tree is dropped
+ * @attention Their pages and inline data are freed here, the slabs holding
+ *            the inodes themselves go at once
+ */
+void cache_destroy() {
+    for (struct fs_inode *inode = lru.lru_next; inode != &lru; inode = inode->lru_next) {
+        file_drop_pages(inode);
+        free(inode->inline_data);
+        inode->inline_data = NULL;
+    }
+    lru.lru_prev = &lru;
+    lru.lru_next = &lru;
+    dirty_list.dirty_prev = &dirty_list;
+    dirty_list.dirty_next = &dirty_list;
+    ndirty = 0;
+}
+
+/**
+ * @brief Check that no inode in the resident subtree of inode is opened or
+ *        still dirty after writeback
+ */
+static int cache_evictable(struct fs_inode *inode) {
+    if (inode->nopen > 0 || inode->dirty || inode->self == super.root) {
+        return 0;
+    }
+    if (inode->self->ftype == FT_DIR && inode->childs_restored) {
+        for (struct fs_dentry *child = inode->childs; child != NULL; child = child->next) {
+            if (child->self != NULL && !cache_evictable(child->self)) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief Check whether inode lives in the subtree of dir
+ */
+static int cache_is_below(struct fs_inode *inode, struct fs_inode *dir) {
+    for (struct fs_dentry *dentry = inode->self->parent; dentry != NULL; dentry = dentry->parent) {
+        if (dentry->self == dir) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Free the resident subtree of inode, and inode itself
+ * @attention Caller should write back dirty inodes first
+ */
+static void cache_drop(struct fs_inode *inode) {
+    if (inode->self->ftype == FT_DIR && inode->childs_restored) {
+        while (inode->childs != NULL) {
+            struct fs_dentry *child = inode->childs;
+            inode->childs = child->next;
+            if (child->self != NULL) {
+                cache_drop(child->self);
+            }
+            dentry_free(child);
+        }
+        inode->childs_restored = (inode->dir_cnt == 0);
+    }
+    inode->self->self = NULL; // * dentry_lookup restores it on demand
+    inode_free(inode);
+}
+
+/**
+ * @brief Evict least recently used clean subtrees until cache usage drops
+ *        below the budget or none is left
+ */
+static void cache_evict() {
+    struct fs_inode *inode = lru.lru_prev;
+    while (cache_over() && inode != &lru) {
+        struct fs_inode *prev = inode->lru_prev;
+        if (cache_evictable(inode)) {
+            // ! Dropping a subtree frees its inodes, prev may be one of them
+            while (prev != &lru && cache_is_below(prev, inode)) {
+                prev = prev->lru_prev;
+            }
+            cache_drop(inode);
+        }
+        inode = prev;
+    }
+}
+
+/**
+ * @brief Evict least recently used inodes and their subtrees until cache
+ *        usage drops below the budget given by --cache
+ * @param writeback whether dirty inodes may be written back to make room.
+ *        Operations pass 0 and leave that to the flusher, which passes 1
+ * @attention Must be called when no caller holds dentry or inode pointers,
+ *            i.e. at the start of a FUSE operation holding the fs lock
+ *            exclusively, or by the flusher
+ */
+void cache_shrink(int writeback) {
+    if (!cache_over()) {
+        return;
+    }
+    cache_evict();
+    if (!cache_over()) {
+        return;
+    }
+    if (!writeback) {
+        flusher_kick();
+        return;
+    }
+    // * One batched writeback makes every subtree safe to drop, but for the
+    //   inodes it could not write, which stay dirty and resident
+    disk_sync();
+    cache_evict();
+}
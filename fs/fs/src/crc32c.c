@@ -0,0 +1,83 @@
+#include "../include/fs.h"
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#define CRC32C_POLY 0x82f63b78u // Castagnoli polynomial, bit-reflected
+
+/* Slice-by-8 tables, table[t][b] is the CRC of byte b followed by t zero bytes */
+static uint32_t crc32c_table[8][256];
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static void crc32c_init_table() {
+    for (uint32_t b = 0; b < 256; b++) {
+        uint32_t crc = b;
+        for (int k = 0; k < 8; k++) {
+            crc = (crc >> 1) ^ (CRC32C_POLY & -(crc & 1));
+        }
+        crc32c_table[0][b] = crc;
+    }
+    for (uint32_t b = 0; b < 256; b++) {
+        for (int t = 1; t < 8; t++) {
+            uint32_t prev = crc32c_table[t - 1][b];
+            crc32c_table[t][b] = (prev >> 8) ^ crc32c_table[0][prev & 0xff];
+        }
+    }
+}
+
+/**
+ * @brief Table-driven CRC32C, 8 bytes per step
+ */
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t len) {
+    pthread_once(&crc32c_once, crc32c_init_table);
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        v ^= crc; // * Little-endian, crc covers the first 4 bytes
+        crc = crc32c_table[7][v & 0xff] ^ crc32c_table[6][(v >> 8) & 0xff] ^
+              crc32c_table[5][(v >> 16) & 0xff] ^ crc32c_table[4][(v >> 24) & 0xff] ^
+              crc32c_table[3][(v >> 32) & 0xff] ^ crc32c_table[2][(v >> 40) & 0xff] ^
+              crc32c_table[1][(v >> 48) & 0xff] ^ crc32c_table[0][v >> 56];
+    }
+    for (; len > 0; p++, len--) {
+        crc = crc32c_table[0][(crc ^ *p) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+/**
+ * @brief CRC32C with the SSE4.2 crc32 instruction, 8 bytes per step
+ */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *p, size_t len) {
+    uint64_t crc64 = crc;
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        crc64 = _mm_crc32_u64(crc64, v);
+    }
+    crc = (uint32_t)crc64;
+    for (; len > 0; p++, len--) {
+        crc = _mm_crc32_u8(crc, *p);
+    }
+    return crc;
+}
+#endif
+
+/**
+ * @brief CRC32C of len bytes, continuing from crc (0 to start)
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+    crc = ~crc;
+#if defined(__x86_64__)
+    static int has_sse42 = -1;
+    if (has_sse42 < 0) {
+        has_sse42 = __builtin_cpu_supports("sse4.2");
+    }
+    if (has_sse42) {
+        return ~crc32c_sse42(crc, (const uint8_t *)buf, len);
+    }
+#endif
+    return ~crc32c_sw(crc, (const uint8_t *)buf, len);
+}
@@ -2,19 +2,25 @@
 
 extern struct fs_super super;
 extern struct custom_options fs_options;			 /* 全局选项 */
+extern struct slab_pool dentry_pool;
+extern struct slab_pool inode_pool;
+
+/* The driver keeps one file position, a seek and its transfers must not interleave with others */
+static pthread_mutex_t io_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /**
- * @brief Read data from disk
+ * @brief Read data from where the live file system has it
  */
-int disk_read(int offset, void *out_content, int size) {
+int disk_read_live(off_t offset, void *out_content, int size) {
     int io_size = super.params.size_io;
 
-    int offset_rounded = DISK_ROUND_DOWN(offset);
-    int size_rounded = DISK_ROUND_UP(size);
+    off_t offset_rounded = DISK_ROUND_DOWN(offset);
+    int size_rounded = DISK_ROUND_UP(offset + size) - offset_rounded;
 
     uint8_t *buffer = (uint8_t*) malloc(size_rounded);
     uint8_t *cur = buffer;
 
+    pthread_mutex_lock(&io_lock);
     ddriver_seek(super.fd, offset_rounded, SEEK_SET);
 
     while (size_rounded > 0) {
@@ -22,6 +28,7 @@ int disk_read(int offset, void *out_content, int size) {
         size_rounded -= io_size;
         cur += io_size;
     }
+    pthread_mutex_unlock(&io_lock);
 
     int bias = offset - offset_rounded;
     memcpy(out_content, buffer + bias, size);
@@ -29,22 +36,37 @@ int disk_read(int offset, void *out_content, int size) {
     return 0;
 }
 
+/**
+ * @brief Read data from disk, or from the snapshot when it is mounted
+ */
+int disk_read(off_t offset, void *out_content, int size) {
+    if (fs_options.snapshot) {
+        return snap_read(offset, out_content, size);
+    }
+    return disk_read_live(offset, out_content, size);
+}
+
 /**
  * @brief Write data to disk
+ * @attention Blocks shared with a snapshot are copied for it first
  */
-int disk_write(int offset, void *in_content, int size) {
+int disk_write(off_t offset, void *in_content, int size) {
     int io_size = super.params.size_io;
+    if (super.snap_blks != 0) {
+        snap_cow_range(offset, size);
+    }
 
-    int offset_rounded = DISK_ROUND_DOWN(offset);
-    int size_rounded = DISK_ROUND_UP(size);
+    off_t offset_rounded = DISK_ROUND_DOWN(offset);
+    int size_rounded = DISK_ROUND_UP(offset + size) - offset_rounded;
 
     uint8_t *buffer = (uint8_t*) malloc(size_rounded);
 
-    disk_read(offset_rounded, buffer, size_rounded);
+    disk_read_live(offset_rounded, buffer, size_rounded);
 
     int bias = offset - offset_rounded;
     memcpy(buffer + bias, in_content, size);
 
+    pthread_mutex_lock(&io_lock);
     ddriver_seek(super.fd, offset_rounded, SEEK_SET);
     uint8_t *cur = buffer;
 
@@ -53,50 +75,380 @@ int disk_write(int offset, void *in_content, int size) {
         size_rounded -= io_size;
         cur += io_size;
     }
+    pthread_mutex_unlock(&io_lock);
 
     free(buffer);
     return 0;
 }
 
 /**
- * @brief Sync inode to disk
+ * @brief Pack the child dentries of directory inode into records
  */
-int inode_sync(struct fs_inode* inode)
+static void dentry_serialize(struct fs_inode* inode, uint8_t* records)
 {
-    struct fs_inode_d inode_d;
+    uint8_t* cur = records;
+    struct fs_dentry* child = inode->childs;
+    while (child != NULL) {
+        struct fs_dentry_d* child_d = (struct fs_dentry_d*)cur;
+        int name_len = strlen(child->name);
+
+        memset(child_d, 0, DENTRY_D_LEN(name_len));
+        child_d->ino = child->ino;
+        child_d->rec_len = DENTRY_D_LEN(name_len);
+        child_d->name_len = name_len;
+        child_d->ftype = child->ftype;
+        memcpy(child_d->name, child->name, name_len);
+
+        cur += child_d->rec_len;
+        child = child->next;
+    }
+}
 
-    inode_d.ino = inode->ino;
-    inode_d.dir_cnt = inode->dir_cnt;
-    inode_d.dno_dir = inode->dno_dir;
-    inode_d.size = inode->size;
-    memcpy(inode_d.dno_reg, inode->dno_reg, sizeof(inode->dno_reg));
-    // Write inode to disk
-    disk_write(
-        (super.inodes_off + inode->ino * sizeof(struct fs_inode_d)),
-        &inode_d,
-        sizeof(struct fs_inode_d)
-    );
-    if (inode->self->ftype == FT_DIR) {
-        // Write dentry to disk
-        struct fs_dentry* child = inode->childs;
-        struct fs_dentry_d child_d;
-        int offset = super.data_off + inode->dno_dir * super.params.size_block;
-        while (child != NULL) {
-            memcpy(child_d.name, child->name, MAX_NAME_LEN);
-            child_d.ino = child->ino;
-            child_d.ftype = child->ftype;
-
-            disk_write(offset, &child_d, sizeof(struct fs_dentry_d));
-
-            if (child->self != NULL) {
-                inode_sync(child->self);
+/**
+ * @brief Tail of an inode record holding its checksums, since FS_VERSION 3
+ */
+static struct fs_inode_tail_d* inode_tail(struct fs_inode_d* inode_d)
+{
+    return (struct fs_inode_tail_d*)((uint8_t*)inode_d + super.inode_size) - 1;
+}
+
+/**
+ * @brief Give committed metadata block *dno a new place in the log, where
+ *        it can be written without the journal
+ * @return 0 if there is no room, *dno then has to be updated in place
+ */
+static int block_relocate(uint32_t* dno)
+{
+    if (dno_fresh(*dno)) {
+        return 1; // * Nothing committed points to it yet
+    }
+    uint32_t len;
+    int to = dno_alloc_meta(*dno, 1, &len);
+    if (to < 0) {
+        return 0;
+    }
+    dno_free(*dno, 1); // * Cannot fail, the bitmaps were loaded to allocate to
+    *dno = to;
+    return 1;
+}
+
+/**
+ * @brief Fill the on-disk record of inode
+ * @attention Records of a directory go inline into inode_d or are written to
+ *            its block here, a new block in log-structured mode
+ */
+static void inode_pack(struct fs_inode* inode, struct fs_inode_d* inode_d)
+{
+    int is_dir = (inode->self->ftype == FT_DIR && inode->childs_restored);
+    int in_log = (super.itab != NULL && is_dir && inode->size > 0 && inode->dno_dir != -1 &&
+                  block_relocate(&inode->dno_dir));
+    memset(inode_d, 0, sizeof(struct fs_inode_d));
+
+    inode_d->ino = inode->ino;
+    inode_d->dir_cnt = inode->dir_cnt;
+    inode_d->dno_dir = inode->dno_dir;
+    inode_d->size = inode->size;
+    for (int i = 0; i < MAX_BLOCK_PER_INODE; i++) {
+        inode_d->dno_reg[i] = inode->dno_reg[i];
+        if (inode->unwritten & (1u << i)) {
+            inode_d->dno_reg[i] |= DNO_UNWRITTEN;
+        }
+    }
+    if (inode->inline_data != NULL) {
+        inode_d->flags |= INODE_INLINE;
+        memcpy(inode_d->inline_data, inode->inline_data, super.inline_max);
+    }
+    if (is_dir && inode->size > 0) {
+        // Small directories keep their records in the inode record,
+        // others write all dentries to their block in one I/O
+        int is_inline = (inode->dno_dir == -1);
+        uint8_t* records = is_inline ? inode_d->inline_data : (uint8_t*)malloc(inode->size);
+        dentry_serialize(inode, records);
+        if (is_inline) {
+            inode_d->flags |= INODE_INLINE;
+        } else {
+            inode->dir_csum = crc32c(0, records, inode->size);
+            if (in_log) {
+                disk_write(DATA_OFF(inode->dno_dir), records, inode->size);
+            } else {
+                journal_write(DATA_OFF(inode->dno_dir), records, inode->size);
             }
+            free(records);
+        }
+    }
+    if (super.csum_off != 0) {
+        struct fs_inode_tail_d* tail = inode_tail(inode_d);
+        tail->dir_csum = inode->dir_csum;
+        tail->csum = crc32c(0, inode_d, super.inode_size);
+    }
+}
 
-            child = child->next;
-            offset += sizeof(struct fs_dentry_d);
+/**
+ * @brief Log the blocks of one group's bitmap slice flagged in mask
+ * @param off offset of the slice of group 0
+ * @param per_group bits per group
+ */
+static void bitmap_journal(struct bitmap* bitmap, off_t off, uint32_t per_group, uint32_t g, uint32_t mask)
+{
+    uint32_t size_block = super.params.size_block;
+    uint8_t* bytes = (uint8_t*)bitmap->words + (size_t)g * per_group / 8;
+    uint32_t slice = (super.groups == 1) ? bitmap_bytes(bitmap) : per_group / 8;
+
+    for (uint32_t k = 0; mask != 0; k++, mask >>= 1) {
+        if (mask & 1) {
+            uint32_t len = slice - k * size_block < size_block ? slice - k * size_block : size_block;
+            journal_write(off + (off_t)g * super.group_size + k * size_block, bytes + k * size_block, len);
         }
     }
-    return ERROR_NONE;
+}
+
+/**
+ * @brief CRC32C of block k of group g's slice of bitmap, over the bytes
+ *        bitmap_journal writes to it
+ */
+static uint32_t bitmap_csum(struct bitmap* bitmap, uint32_t per_group, uint32_t g, uint32_t k)
+{
+    uint32_t size_block = super.params.size_block;
+    uint8_t* bytes = (uint8_t*)bitmap->words + (size_t)g * per_group / 8;
+    uint32_t slice = (super.groups == 1) ? bitmap_bytes(bitmap) : per_group / 8;
+    uint32_t len = slice - k * size_block < size_block ? slice - k * size_block : size_block;
+    return crc32c(0, bytes + k * size_block, len);
+}
+
+/**
+ * @brief Fill the checksum block of group g from the in-memory bitmaps
+ */
+static void csum_pack(uint32_t g, uint32_t* csums)
+{
+    memset(csums, 0, super.params.size_block);
+    for (uint32_t k = 0; k < super.imap_blks; k++) {
+        csums[k] = bitmap_csum(super.imap, super.ipg, g, k);
+    }
+    for (uint32_t k = 0; k < super.dmap_blks; k++) {
+        csums[super.imap_blks + k] = bitmap_csum(super.dmap, super.dpg, g, k);
+    }
+    for (uint32_t k = 0; super.itab != NULL && k < super.inodes_blks; k++) {
+        csums[super.imap_blks + super.dmap_blks + k] = log_itab_csum(g, k);
+    }
+}
+
+/**
+ * @brief Log every bitmap block changed since the last sync, and every
+ *        block of the itab in log-structured mode
+ * @attention Blocks of the transaction shared with a snapshot are copied
+ *            now, and the bitmap blocks those copies dirty join the same
+ *            transaction, like the map entries of blocks it took over
+ */
+static void bitmap_journal_dirty()
+{
+    uint32_t* csums = (uint32_t*)malloc(super.params.size_block);
+    snap_journal_taken();
+    do {
+        if (super.imap == NULL || super.readonly) {
+            continue; // * Not loaded, so nothing was allocated or freed, or not to be trusted
+        }
+        for (uint32_t g = 0; g < super.groups; g++) {
+            if (super.csum_off != 0 && (super.gd[g].imap_dirty | super.gd[g].dmap_dirty | super.gd[g].itab_dirty)) {
+                csum_pack(g, csums);
+                journal_write(super.csum_off + (off_t)g * super.group_size, csums, super.params.size_block);
+            }
+            if (super.itab != NULL) {
+                log_journal_itab(g);
+            }
+            bitmap_journal(super.imap, super.imap_off, super.ipg, g, super.gd[g].imap_dirty);
+            bitmap_journal(super.dmap, super.dmap_off, super.dpg, g, super.gd[g].dmap_dirty);
+            super.gd[g].imap_dirty = 0;
+            super.gd[g].dmap_dirty = 0;
+        }
+    } while (journal_preserve() > 0);
+    free(csums);
+}
+
+/**
+ * @brief Sync one inode to disk, data pages first
+ * @attention Its record, directory block and the changed bitmap blocks are
+ *            committed as one transaction. Pages that found no block keep
+ *            inode dirty, and their error is returned
+ */
+int inode_sync(struct fs_inode* inode)
+{
+    int ret = ERROR_NONE;
+    if (inode->self->ftype == FT_REG) {
+        ret = file_flush(inode);
+    }
+    journal_begin();
+    int synced = 1;
+    if (cache_is_dirty(inode)) {
+        struct fs_inode_d inode_d;
+        inode_pack(inode, &inode_d);
+        if (super.itab != NULL) {
+            synced = log_write_inodes(&inode->ino, (uint8_t*)&inode_d, 1);
+        } else {
+            journal_write(INODE_OFF(inode->ino), &inode_d, super.inode_size);
+        }
+    }
+    bitmap_journal_dirty();
+    journal_commit();
+    if (synced && ret == ERROR_NONE) {
+        cache_mark_clean(inode);
+    }
+    return synced ? ret : ERROR_NOSPACE;
+}
+
+static int inode_cmp_ino(const void* a, const void* b)
+{
+    uint32_t x = (*(struct fs_inode**)a)->ino;
+    uint32_t y = (*(struct fs_inode**)b)->ino;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief inode_pack under the lock of inode
+ * @attention fsync syncs under the shared lock, beside writers of inode
+ */
+static void inode_pack_locked(struct fs_inode* inode, struct fs_inode_d* inode_d)
+{
+    pthread_rwlock_wrlock(&inode->lock);
+    inode_pack(inode, inode_d);
+    pthread_rwlock_unlock(&inode->lock);
+}
+
+/**
+ * @brief Append the records of the dirty inodes of batch to the log
+ * @param left gets the inodes whose record found no room in the log
+ * @return number of them
+ */
+static int disk_sync_log(struct fs_inode** batch, int n, struct fs_inode** left)
+{
+    uint32_t* inos = (uint32_t*)malloc(n * sizeof(uint32_t));
+    uint8_t* records = (uint8_t*)malloc((size_t)n * super.inode_size);
+    int m = 0;
+    for (int i = 0; i < n; i++) {
+        if (cache_is_dirty(batch[i])) {
+            struct fs_inode_d inode_d;
+            inode_pack_locked(batch[i], &inode_d);
+            memcpy(records + (size_t)m * super.inode_size, &inode_d, super.inode_size);
+            inos[m] = batch[i]->ino;
+            left[m++] = batch[i];
+        }
+    }
+    int done = log_write_inodes(inos, records, m);
+    for (int i = done; i < m; i++) {
+        left[i - done] = left[i];
+    }
+    free(inos);
+    free(records);
+    return m - done;
+}
+
+/**
+ * @brief Write back every inode on the dirty list
+ * @attention Data pages are flushed before any record. Records sharing an
+ *            inode-table block are patched into it and written with one I/O,
+ *            the block is only read when the batch does not cover all of it.
+ *            In log-structured mode they are appended to the log instead.
+ *            All metadata, bitmaps included, is committed as one transaction.
+ *            Every other caller holds fs_lock exclusively; fsync holds it
+ *            shared under fsync_lock, so each inode is flushed and packed
+ *            under its own lock, and one dirtied again meanwhile stays dirty
+ * @return the first error of a file whose pages could not all be written,
+ *         it stays dirty with them for the next sync
+ */
+static int disk_sync_once()
+{
+    int n = 0, cap = 16;
+    struct fs_inode** batch = (struct fs_inode**)malloc(cap * sizeof(struct fs_inode*));
+    struct fs_inode* inode;
+    while ((inode = cache_dirty_pop()) != NULL) {
+        if (n == cap) {
+            cap *= 2;
+            batch = (struct fs_inode**)realloc(batch, cap * sizeof(struct fs_inode*));
+        }
+        batch[n++] = inode;
+    }
+    // Inodes to keep on the dirty list, at most twice each
+    struct fs_inode** left = (struct fs_inode**)malloc(2 * n * sizeof(struct fs_inode*) + 1);
+    int nleft = 0;
+    int ret = ERROR_NONE;
+    for (int i = 0; i < n; i++) {
+        pthread_rwlock_wrlock(&batch[i]->lock);
+        if (batch[i]->self->ftype == FT_REG) {
+            int err = file_flush(batch[i]);
+            if (err != ERROR_NONE) {
+                ret = (ret == ERROR_NONE) ? err : ret;
+                left[nleft++] = batch[i];
+            }
+        }
+        batch[i]->sync_gen = cache_dirty_gen(batch[i]); // * Flushing dirties it too
+        pthread_rwlock_unlock(&batch[i]->lock);
+    }
+    qsort(batch, n, sizeof(struct fs_inode*), inode_cmp_ino);
+
+    journal_begin();
+    int size_block = super.params.size_block;
+    int per_block = size_block / super.inode_size;
+    uint8_t* blk = (uint8_t*)malloc(size_block);
+    if (super.itab != NULL) {
+        int unlogged = disk_sync_log(batch, n, left + nleft);
+        nleft += unlogged;
+        if (unlogged > 0 && ret == ERROR_NONE) {
+            ret = ERROR_NOSPACE;
+        }
+    }
+    for (int i = 0; super.itab == NULL && i < n; ) {
+        if (!cache_is_dirty(batch[i])) {
+            i++;
+            continue;
+        }
+        off_t blk_off = BLK_ROUND_DOWN(INODE_OFF(batch[i]->ino));
+        int end = i;
+        int covered = 0;
+        while (end < n && INODE_OFF(batch[end]->ino) < blk_off + size_block) {
+            covered += cache_is_dirty(batch[end]);
+            end++;
+        }
+        if (covered < per_block) {
+            disk_read(blk_off, blk, size_block);
+        }
+        for (int j = i; j < end; j++) {
+            if (cache_is_dirty(batch[j])) {
+                struct fs_inode_d inode_d;
+                inode_pack_locked(batch[j], &inode_d);
+                memcpy(blk + (INODE_OFF(batch[j]->ino) - blk_off), &inode_d, super.inode_size);
+            }
+        }
+        journal_write(blk_off, blk, size_block);
+        i = end;
+    }
+    bitmap_journal_dirty();
+    journal_commit();
+
+    for (int i = 0; i < n; i++) {
+        cache_mark_synced(batch[i], batch[i]->sync_gen);
+    }
+    for (int i = 0; i < nleft; i++) {
+        cache_mark_dirty(left[i]); // * No block for its pages or no room in the log, retried by the next sync
+    }
+    free(left);
+    free(blk);
+    free(batch);
+    return ret;
+}
+
+/**
+ * @brief Write back every inode on the dirty list, see disk_sync_once
+ * @attention Blocks freed since the last commit are not handed out before
+ *            it, so pages that found no block only for them get a second
+ *            pass once the commit has released them
+ */
+int disk_sync()
+{
+    int held = dno_freed_count() > 0;
+    int ret = disk_sync_once();
+    if (ret == ERROR_NOSPACE && held) {
+        ret = disk_sync_once();
+    }
+    return ret;
 }
 
 /**
@@ -105,40 +457,225 @@ int inode_sync(struct fs_inode* inode)
 int dentry_restore(struct fs_dentry* dentry, int ino)
 {
     struct fs_inode_d inode_d;
+    memset(&inode_d, 0, sizeof(struct fs_inode_d));
 
+    off_t off = super.itab != NULL ? log_inode_off(ino) : INODE_OFF(ino);
+    if (off < 0) {
+        fprintf(stderr, "fs: inode %d has no record, run fsck.fs\n", ino);
+        return ERROR_IO;
+    }
     disk_read(
-        (super.inodes_off + ino * sizeof(struct fs_inode_d)),
+        off,
         &inode_d,
-        sizeof(struct fs_inode_d)
+        super.inode_size
     );
+    if (super.csum_off != 0) {
+        struct fs_inode_tail_d* tail = inode_tail(&inode_d);
+        uint32_t csum = tail->csum;
+        tail->csum = 0;
+        if (crc32c(0, &inode_d, super.inode_size) != csum) {
+            fprintf(stderr, "fs: inode %d fails its checksum, run fsck.fs\n", ino);
+            return ERROR_IO;
+        }
+    }
 
-    struct fs_inode* inode = (struct fs_inode*)malloc(sizeof(struct fs_inode));
+    struct fs_inode* inode = inode_create();
+    if (inode == NULL) {
+        return ERROR_NOMEM;
+    }
     inode->self = dentry;
     inode->ino = inode_d.ino;
     inode->dir_cnt = inode_d.dir_cnt;
-    inode->childs = NULL;
 
     inode->size = inode_d.size;
     inode->dno_dir = inode_d.dno_dir;
-    memcpy(inode->dno_reg, inode_d.dno_reg, sizeof(inode->dno_reg));
+    for (int i = 0; i < MAX_BLOCK_PER_INODE; i++) {
+        inode->dno_reg[i] = inode_d.dno_reg[i];
+        if (inode->dno_reg[i] != -1 && (inode->dno_reg[i] & DNO_UNWRITTEN)) {
+            inode->dno_reg[i] &= ~DNO_UNWRITTEN;
+            inode->unwritten |= 1u << i;
+        }
+    }
+    if (inode_d.flags & INODE_INLINE) {
+        inode->inline_data = (uint8_t*)malloc(super.inline_max);
+        memcpy(inode->inline_data, inode_d.inline_data, super.inline_max);
+    }
+    if (super.csum_off != 0) {
+        inode->dir_csum = inode_tail(&inode_d)->dir_csum;
+    }
 
-    dentry->self = inode;
     dentry->ino = inode_d.ino;
-    
-    if (dentry->ftype == FT_DIR) {
-        int offset = super.data_off + inode->dno_dir * super.params.size_block;
 
-        struct fs_dentry_d child_d;
-        struct fs_dentry* child;
+    // * Child dentries are restored on first access, see dentry_restore_childs
+    inode->childs_restored = (dentry->ftype != FT_DIR || inode->dir_cnt == 0);
+    cache_touch(inode);
+    __atomic_store_n(&dentry->self, inode, __ATOMIC_RELEASE); // * Last, see dentry_load
+    return ERROR_NONE;
+}
+
+/**
+ * @brief Restore child dentries of a directory from disk
+ * @attention The whole directory is read in one I/O and parsed in memory,
+ *            child inodes are still restored lazily by dentry_lookup
+ */
+int dentry_restore_childs(struct fs_inode* inode)
+{
+    if (inode->childs_restored) {
+        return ERROR_NONE;
+    }
+
+    // * FS_VERSION_V0 directories never recorded their size
+    int is_v0 = (super.version == FS_VERSION_V0 && inode->size == 0);
+    int dir_cnt = inode->dir_cnt;
+    int size = is_v0 ? dir_cnt * sizeof(struct fs_dentry_d_v0) : inode->size;
+
+    uint8_t* inline_data = inode->inline_data;
+    uint8_t* records = inline_data;
+    if (records == NULL) {
+        records = (uint8_t*)malloc(size);
+        disk_read(DATA_OFF(inode->dno_dir), records, size);
+        if (super.csum_off != 0 && crc32c(0, records, size) != inode->dir_csum) {
+            fprintf(stderr, "fs: directory %u fails its checksum, run fsck.fs\n", inode->ino);
+            free(records);
+            return ERROR_IO;
+        }
+    }
+    // * From now on the dentries in childs are authoritative
+    inode->inline_data = NULL;
+
+    // * Linked like dentry_register does, size is recounted for FS_VERSION_V0
+    size = 0;
+    struct fs_dentry* child;
+    uint8_t* cur = records;
+    int nomem = 0;
+    char name[MAX_NAME_LEN];
+    for (int i = 0; i < dir_cnt; i++) {
+        if (is_v0) {
+            struct fs_dentry_d_v0* child_d = (struct fs_dentry_d_v0*)cur;
+            child = dentry_create(child_d->name, child_d->ftype);
+            if (child == NULL) {
+                nomem = 1;
+                break;
+            }
+            child->ino = child_d->ino;
+            cur += sizeof(struct fs_dentry_d_v0);
+        } else {
+            struct fs_dentry_d* child_d = (struct fs_dentry_d*)cur;
+            memcpy(name, child_d->name, child_d->name_len);
+            name[child_d->name_len] = '\0';
+            child = dentry_create(name, child_d->ftype);
+            if (child == NULL) {
+                nomem = 1;
+                break;
+            }
+            child->ino = child_d->ino;
+            cur += child_d->rec_len;
+        }
+
+        child->parent = inode->self;
+        child->next = inode->childs;
+        inode->childs = child;
+        size += DENTRY_D_LEN(strlen(child->name));
+    }
+    if (nomem) {
+        // * Out of memory, undo so the next lookup starts over
+        while (inode->childs != NULL) {
+            child = inode->childs;
+            inode->childs = child->next;
+            dentry_free(child);
+        }
+        if (records != inline_data) {
+            free(records);
+        }
+        inode->inline_data = inline_data;
+        return ERROR_NOMEM;
+    }
+    free(records);
+
+    // * Restored dentries are not modifications
+    inode->size = size;
+    __atomic_store_n(&inode->childs_restored, 1, __ATOMIC_RELEASE); // * Last, see dentry_load
+    return ERROR_NONE;
+}
+
+/**
+ * @brief Read or write blocks [blk_start, blk_start + blk_cnt) of file
+ * @attention Physically contiguous blocks are transferred in one I/O,
+ *            reads prefer dirty pages and inline data, holes and unwritten
+ *            blocks read as zeros, holes must be allocated before writing
+ */
+static int file_blk_io(struct fs_inode* file, int blk_start, int blk_cnt, uint8_t* buf, int is_write)
+{
+    int io_size = super.params.size_block;
+    int end = blk_start + blk_cnt;
+
+    for (int i = blk_start; i < end; ) {
+        uint8_t* cur = buf + (i - blk_start) * io_size;
+        if (!is_write && file->pages[i] != NULL) {
+            memcpy(cur, file->pages[i], io_size);
+            i++;
+            continue;
+        }
+        if (!is_write && i == 0 && file->inline_data != NULL) {
+            memcpy(cur, file->inline_data, super.inline_max);
+            memset(cur + super.inline_max, 0, io_size - super.inline_max);
+            i++;
+            continue;
+        }
+        if (file->dno_reg[i] == -1 || (!is_write && (file->unwritten & (1u << i)))) {
+            memset(cur, 0, io_size);
+            i++;
+            continue;
+        }
+        int run = 1;
+        while (i + run < end && file->dno_reg[i + run] == file->dno_reg[i] + run &&
+               DNO_GROUP(file->dno_reg[i + run]) == DNO_GROUP(file->dno_reg[i]) &&
+               (is_write || (file->pages[i + run] == NULL && !(file->unwritten & (1u << (i + run)))))) {
+            run++;
+        }
+        off_t offset = DATA_OFF(file->dno_reg[i]);
+        if (is_write) {
+            disk_write(offset, cur, run * io_size);
+        } else {
+            disk_read(offset, cur, run * io_size);
+        }
+        i += run;
+    }
+    return ERROR_NONE;
+}
 
-        for (int i = 0; i < inode->dir_cnt; i++) {
-            disk_read(offset + i * sizeof(struct fs_dentry_d), &child_d, sizeof(struct fs_dentry_d));
-            child = dentry_create(child_d.name, child_d.ftype);
-            child->ino = child_d.ino;
+/**
+ * @brief Allocate every hole holding a dirty page, or every hole at all when
+ *        prealloc is set, in blocks [blk_start, blk_start + blk_cnt) of file
+ * @attention Each run of such holes is allocated as one contiguous range right
+ *            after the preceding block of the file when possible
+ */
+static int file_blk_alloc(struct fs_inode* file, int blk_start, int blk_cnt, int prealloc)
+{
+    int end = blk_start + blk_cnt;
 
-            dentry_register(child, dentry); // register child to parent
+    for (int i = blk_start; i < end; ) {
+        if (file->dno_reg[i] != -1 || (!prealloc && file->pages[i] == NULL)) {
+            i++;
+            continue;
+        }
+        int want = 1;
+        while (i + want < end && file->dno_reg[i + want] == -1 &&
+               (prealloc || file->pages[i + want] != NULL)) {
+            want++;
+        }
+        uint32_t goal = (i > 0 && file->dno_reg[i - 1] != -1) ? file->dno_reg[i - 1] + 1 : dno_goal(file);
+        uint32_t len;
+        int dno = dno_alloc(goal, want, 1, &len);
+        if (dno < 0) {
+            return ERROR_NOSPACE;
         }
+        for (uint32_t j = 0; j < len; j++) {
+            file->dno_reg[i + j] = dno + j;
+        }
+        i += len;
     }
+    return ERROR_NONE;
 }
 
 /**
@@ -149,29 +686,11 @@ int file_read(struct fs_inode* file, int offset, void *buf, int size)
     int io_size = super.params.size_block;
 
     int offset_rounded = BLK_ROUND_DOWN(offset);
-    int size_rounded = BLK_ROUND_UP(size);
+    int size_rounded = BLK_ROUND_UP(offset + size) - offset_rounded;
 
     uint8_t* buffer = (uint8_t*)malloc(size_rounded);
-    uint8_t* cur = buffer;
 
-    int blk_ptr = offset_rounded / io_size;
-
-    while (size_rounded > 0) {
-        // ! Every block read from disk
-        // ! may cause performance issue
-        if (file->dno_reg[blk_ptr] == -1) {
-            memset(cur, 0, io_size);
-        } else {
-            disk_read(
-                super.data_off + file->dno_reg[blk_ptr] * super.params.size_block,
-                cur,
-                io_size
-            );
-        }
-        cur += io_size;
-        size_rounded -= io_size;
-        blk_ptr++;
-    }
+    file_blk_io(file, offset_rounded / io_size, size_rounded / io_size, buffer, 0);
 
     int bias = offset - offset_rounded;
     memcpy(buf, buffer + bias, size);
@@ -182,49 +701,575 @@ int file_read(struct fs_inode* file, int offset, void *buf, int size)
 
 /**
  * @brief Write data to file
+ * @attention Data only lands in the in-memory pages of file, blocks are
+ *            reserved here and allocated by file_flush at writeback
  */
 int file_write(struct fs_inode* file, int offset, void *buf, int size)
 {
     int io_size = super.params.size_block;
 
-    int offset_rounded = BLK_ROUND_DOWN(offset);
-    int size_rounded = BLK_ROUND_UP(size);
+    if (size == 0) {
+        return ERROR_NONE;
+    }
+    if (file->inline_data != NULL && offset + size > super.inline_max) {
+        int ret = file_uninline(file);
+        if (ret != ERROR_NONE) {
+            return ret;
+        }
+    }
+    int blk_start = offset / io_size;
+    int blk_end = BLK_ROUND_UP(offset + size) / io_size;
 
-    int blk_start = offset_rounded / io_size;
-    int blk_ptr = blk_start;
+    uint32_t new_holes = 0;
+    for (int i = blk_start; i < blk_end; i++) {
+        if (file->pages[i] == NULL && file->dno_reg[i] == -1) {
+            new_holes++;
+        }
+    }
+    if (dno_reserve(new_holes) != ERROR_NONE) {
+        return ERROR_NOSPACE;
+    }
 
-    uint8_t* buffer = (uint8_t*)malloc(size_rounded);
+    uint8_t* cur = (uint8_t*)buf;
+    for (int i = blk_start; i < blk_end; i++) {
+        int blk_off = i * io_size;
+        int from = offset > blk_off ? offset - blk_off : 0;
+        int to = offset + size < blk_off + io_size ? offset + size - blk_off : io_size;
+
+        if (file->pages[i] == NULL) {
+            uint8_t* page = (uint8_t*)malloc(io_size);
+            // Only partially overwritten blocks need their old content
+            if (from != 0 || to != io_size) {
+                file_blk_io(file, i, 1, page, 0);
+            }
+            file->pages[i] = page;
+            __atomic_add_fetch(&super.dirty_pages, 1, __ATOMIC_RELAXED);
+        }
+        memcpy(file->pages[i] + from, cur, to - from);
+        cur += to - from;
+    }
+    return ERROR_NONE;
+}
+
+/**
+ * @brief Discard the dirty page of block blk and the block reserved for it
+ */
+static void file_drop_page(struct fs_inode* file, int blk)
+{
+    if (file->pages[blk] != NULL) {
+        if (file->dno_reg[blk] == -1) {
+            dno_unreserve(1);
+        }
+        free(file->pages[blk]);
+        file->pages[blk] = NULL;
+        __atomic_sub_fetch(&super.dirty_pages, 1, __ATOMIC_RELAXED);
+    }
+}
 
-    for (int i = 0; i < size_rounded; i += io_size) {
-        if (file->dno_reg[blk_ptr] == -1) {
-            memset(buffer + i, 0, io_size);
+/**
+ * @brief Keep the data of file in its inode record if it fits
+ * @return 1 if file is inline, its dirty page is then folded into inline_data
+ * @attention Files that already own blocks are never moved back inline
+ */
+static int file_inline(struct fs_inode* file)
+{
+    if (file->inline_data == NULL) {
+        if (super.inline_max == 0 || file->size == 0 || file->size > super.inline_max) {
+            return 0;
+        }
+        for (int i = 0; i < MAX_BLOCK_PER_INODE; i++) {
+            if (file->dno_reg[i] != -1 || (i > 0 && file->pages[i] != NULL)) {
+                return 0;
+            }
+        }
+        file->inline_data = (uint8_t*)calloc(1, super.inline_max);
+        cache_mark_dirty(file);
+    }
+    if (file->pages[0] != NULL) {
+        memcpy(file->inline_data, file->pages[0], super.inline_max);
+        file_drop_page(file, 0);
+        cache_mark_dirty(file);
+    }
+    return 1;
+}
+
+/**
+ * @brief Move inline data of file back into block 0
+ * @attention The block is only reserved, it is allocated at writeback
+ */
+int file_uninline(struct fs_inode* file)
+{
+    if (file->inline_data == NULL) {
+        return ERROR_NONE;
+    }
+    if (file->pages[0] == NULL) {
+        if (dno_reserve(1) != ERROR_NONE) {
+            return ERROR_NOSPACE;
+        }
+        uint8_t* page = (uint8_t*)calloc(1, super.params.size_block);
+        memcpy(page, file->inline_data, super.inline_max);
+        file->pages[0] = page;
+        __atomic_add_fetch(&super.dirty_pages, 1, __ATOMIC_RELAXED);
+    }
+    free(file->inline_data);
+    file->inline_data = NULL;
+    cache_mark_dirty(file);
+    return ERROR_NONE;
+}
+
+/**
+ * @brief Write back the dirty pages of file
+ * @attention All delayed blocks are allocated at once, so the file gets
+ *            contiguous blocks whatever order its writes came in.
+ *            In log-structured mode committed blocks are moved to the log
+ *            along with them, or overwritten in place if it has no room
+ * @return ERROR_NOSPACE if some pages found no block, they are kept with
+ *         their reservation and file stays dirty
+ */
+int file_flush(struct fs_inode* file)
+{
+    int io_size = super.params.size_block;
+    uint32_t delayed = 0;
+    uint32_t moved[MAX_BLOCK_PER_INODE];
+    int dirty = 0;
+
+    if (file_inline(file)) {
+        return ERROR_NONE;
+    }
+
+    for (int i = 0; i < MAX_BLOCK_PER_INODE; i++) {
+        moved[i] = -1;
+        if (file->pages[i] != NULL) {
+            dirty = 1;
+            if (file->dno_reg[i] == -1) {
+                delayed++;
+            } else if (super.itab != NULL && !dno_fresh(file->dno_reg[i])) {
+                moved[i] = file->dno_reg[i];
+                file->dno_reg[i] = -1;
+            }
+        }
+    }
+    if (!dirty) {
+        return ERROR_NONE;
+    }
+
+    dno_unreserve(delayed);
+    int ret = file_blk_alloc(file, 0, MAX_BLOCK_PER_INODE, 0);
+    for (int i = 0; i < MAX_BLOCK_PER_INODE; i++) {
+        if (moved[i] == -1) {
+            continue;
+        }
+        if (file->dno_reg[i] == -1) {
+            file->dno_reg[i] = moved[i];
         } else {
-            disk_read(
-                super.data_off + file->dno_reg[blk_ptr] * super.params.size_block,
-                buffer + i,
-                io_size
-            );
+            dno_free(moved[i], 1); // * Cannot fail, the bitmaps were loaded to allocate its new place
+            cache_mark_dirty(file);
+        }
+    }
+    if (ret != ERROR_NONE) {
+        uint32_t unallocated = 0;
+        for (int i = 0; i < MAX_BLOCK_PER_INODE; i++) {
+            if (file->pages[i] != NULL && file->dno_reg[i] == -1) {
+                unallocated++;
+            }
+        }
+        dno_rereserve(unallocated);
+        ret = unallocated > 0 ? ERROR_NOSPACE : ERROR_NONE;
+    }
+    if (delayed > 0) {
+        cache_mark_dirty(file);
+    }
+
+    for (int i = 0; i < MAX_BLOCK_PER_INODE; ) {
+        if (file->pages[i] == NULL || file->dno_reg[i] == -1) {
+            i++;
+            continue;
+        }
+        int run = 1;
+        while (i + run < MAX_BLOCK_PER_INODE && file->pages[i + run] != NULL &&
+               file->dno_reg[i + run] != -1) {
+            run++;
+        }
+        uint8_t* buffer = (uint8_t*)malloc(run * io_size);
+        for (int j = 0; j < run; j++) {
+            memcpy(buffer + j * io_size, file->pages[i + j], io_size);
+        }
+        file_blk_io(file, i, run, buffer, 1);
+        free(buffer);
+        for (int j = i; j < i + run; j++) {
+            if (file->unwritten & (1u << j)) {
+                file->unwritten &= ~(1u << j);
+                cache_mark_dirty(file);
+            }
+        }
+        i += run;
+    }
+    // Reservations of written pages were already given back above
+    for (int i = 0; i < MAX_BLOCK_PER_INODE; i++) {
+        if (file->pages[i] != NULL && file->dno_reg[i] != -1) {
+            free(file->pages[i]);
+            file->pages[i] = NULL;
+            __atomic_sub_fetch(&super.dirty_pages, 1, __ATOMIC_RELAXED);
+        }
+    }
+    return ret;
+}
+
+/**
+ * @brief Discard the dirty pages of file and the blocks reserved for them
+ */
+void file_drop_pages(struct fs_inode* file)
+{
+    for (int i = 0; i < MAX_BLOCK_PER_INODE; i++) {
+        file_drop_page(file, i);
+    }
+}
+
+/**
+ * @brief Zero bytes [offset, offset + len) within one block of file
+ */
+static int file_zero_bytes(struct fs_inode* file, int offset, int len)
+{
+    int blk = offset / super.params.size_block;
+    if (len == 0 || (file->pages[blk] == NULL &&
+        (file->dno_reg[blk] == -1 || (file->unwritten & (1u << blk))))) {
+        return ERROR_NONE; // already reads as zeros
+    }
+    uint8_t* zeros = (uint8_t*)calloc(1, len);
+    int ret = file_write(file, offset, zeros, len);
+    free(zeros);
+    return ret;
+}
+
+/**
+ * @brief Preallocate, punch or zero [offset, offset + len) of file
+ * @attention Preallocated blocks are unwritten: they are allocated as one
+ *            contiguous range but read as zeros until written back. Punched
+ *            blocks go back to the data bitmap, zeroed blocks keep their
+ *            allocation and become unwritten. Partial blocks at both ends are
+ *            zeroed through file_write.
+ */
+int file_fallocate(struct fs_inode* file, int mode, int offset, int len)
+{
+    int io_size = super.params.size_block;
+    int end = offset + len;
+
+    int ret = file_uninline(file);
+    if (ret != ERROR_NONE) {
+        return ret;
+    }
+
+    // Blocks fully covered by the range
+    int blk_start = BLK_ROUND_UP(offset) / io_size;
+    int blk_end = BLK_ROUND_DOWN(end) / io_size;
+
+    if (mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE)) {
+        int head_end = blk_start * io_size < end ? blk_start * io_size : end;
+        ret = file_zero_bytes(file, offset, head_end - offset);
+        if (ret == ERROR_NONE && blk_end * io_size > head_end) {
+            ret = file_zero_bytes(file, blk_end * io_size, end - blk_end * io_size);
+        }
+        if (ret != ERROR_NONE) {
+            return ret;
+        }
+        for (int i = blk_start; i < blk_end; i++) {
+            file_drop_page(file, i);
+            if (file->dno_reg[i] == -1) {
+                continue;
+            }
+            if (mode & FALLOC_FL_PUNCH_HOLE) {
+                if (dno_free(file->dno_reg[i], 1) != ERROR_NONE) {
+                    return ERROR_IO;
+                }
+                file->dno_reg[i] = -1;
+                file->unwritten &= ~(1u << i);
+            } else {
+                file->unwritten |= 1u << i;
+            }
+            cache_mark_dirty(file);
+        }
+        if (mode & FALLOC_FL_PUNCH_HOLE) {
+            return ERROR_NONE;
         }
-        blk_ptr++;
     }
 
-    memcpy(buffer + offset_rounded - offset, buf, size);
+    // Preallocate every block touched by the range
+    blk_start = offset / io_size;
+    blk_end = BLK_ROUND_UP(end) / io_size;
 
-    blk_ptr = blk_start;
-    for (int i = 0; i < size_rounded; i += io_size) {
-        if (file->dno_reg[blk_ptr] == -1) {
-            file->dno_reg[blk_ptr] = bitmap_alloc(super.dmap, super.params.max_dno);
+    uint32_t holes = 0, delayed = 0, hole_mask = 0;
+    for (int i = blk_start; i < blk_end; i++) {
+        if (file->dno_reg[i] == -1) {
+            holes++;
+            delayed += (file->pages[i] != NULL);
+            hole_mask |= 1u << i;
         }
-        disk_write(
-            super.data_off + file->dno_reg[blk_ptr] * super.params.size_block,
-            buffer + i,
-            io_size
-        );
-        blk_ptr++;
+    }
+    if (maps_load() != ERROR_NONE) {
+        return ERROR_IO;
+    }
+    dno_drain(); // * Blocks cached for writers would count as taken
+    if (super.dmap->free + delayed < super.reserved + holes) {
+        return ERROR_NOSPACE;
+    }
+    // Delayed pages in the range get their blocks now
+    dno_unreserve(delayed);
+    ret = file_blk_alloc(file, blk_start, blk_end - blk_start, 1);
+    for (int i = blk_start; i < blk_end; i++) {
+        if ((hole_mask & (1u << i)) && file->dno_reg[i] != -1 && file->pages[i] == NULL) {
+            file->unwritten |= 1u << i;
+        }
+    }
+    cache_mark_dirty(file);
+    return ret;
+}
+
+/**
+ * @brief Cut file down to offset bytes
+ * @attention Every block past the new end is dropped: its dirty page and
+ *            reservation, and its committed block, which goes back to the
+ *            data bitmap. The rest of the block holding offset is zeroed,
+ *            so growing the file again reads zeros there.
+ *            An inline file growing past inline_max moves to block 0 first.
+ */
+int file_truncate(struct fs_inode* file, int offset)
+{
+    int io_size = super.params.size_block;
+
+    if (file->inline_data != NULL) {
+        if (offset > super.inline_max) {
+            return file_uninline(file);
+        }
+        if (offset < file->size) {
+            memset(file->inline_data + offset, 0, super.inline_max - offset);
+            if (file->pages[0] != NULL) {
+                memset(file->pages[0] + offset, 0, io_size - offset);
+            }
+            cache_mark_dirty(file);
+        }
+        return ERROR_NONE;
+    }
+    if (offset >= file->size) {
+        return ERROR_NONE; // * Past the old end the file already reads as zeros
+    }
+
+    int blk_start = BLK_ROUND_UP(offset) / io_size;
+    int ret = file_zero_bytes(file, offset, blk_start * io_size - offset);
+    if (ret != ERROR_NONE) {
+        return ret;
+    }
+    for (int i = blk_start; i < MAX_BLOCK_PER_INODE; i++) {
+        file_drop_page(file, i);
+        if (file->dno_reg[i] == -1) {
+            continue;
+        }
+        if (dno_free(file->dno_reg[i], 1) != ERROR_NONE) {
+            return ERROR_IO;
+        }
+        file->dno_reg[i] = -1;
+        file->unwritten &= ~(1u << i);
+        cache_mark_dirty(file);
     }
     return ERROR_NONE;
 }
 
+/**
+ * @brief Read or write a whole bitmap whose slices live at the head of every group
+ * @param off offset of the slice of group 0
+ * @param per_group bits per group, a multiple of 8 when there are several groups
+ */
+static void bitmap_sync(struct bitmap *bitmap, off_t off, uint32_t per_group, int is_write) {
+    uint8_t *bytes = (uint8_t *)bitmap->words;
+    if (super.groups == 1) {
+        if (is_write) {
+            disk_write(off, bytes, bitmap_bytes(bitmap));
+        } else {
+            disk_read(off, bytes, bitmap_bytes(bitmap));
+        }
+        return;
+    }
+    for (uint32_t g = 0; g < super.groups; g++) {
+        off_t group_off = off + (off_t)g * super.group_size;
+        if (is_write) {
+            disk_write(group_off, bytes + g * per_group / 8, per_group / 8);
+        } else {
+            disk_read(group_off, bytes + g * per_group / 8, per_group / 8);
+        }
+    }
+}
+
+/**
+ * @brief Number of blocks in a device of size_disk bytes
+ * @attention size_disk is an int in DiskParam and in IOC_REQ_DEVICE_SIZE,
+ *            devices of 2 GiB and more only fit it read back as unsigned
+ */
+static uint32_t disk_blocks(int size_disk, uint32_t size_block) {
+    uint64_t bytes = (uint32_t)size_disk;
+    return (uint32_t)(bytes / size_block);
+}
+
+/**
+ * @brief Derive the layout of a fresh filesystem from the device size
+ * @attention The disk is cut into equal block groups of at most
+ *            FS_MAX_GROUP_BLOCKS blocks, but at least FS_MIN_GROUPS of them.
+ *            Each group gets one inode per FS_BYTES_PER_INODE bytes, and its
+ *            bitmaps take as many blocks as their bits need. In log-structured
+ *            mode the inode unit only holds the itab of the group.
+ */
+static void fs_geometry(struct fs_super_d *super_d) {
+    uint32_t size_block = super_d->param.size_block;
+    uint32_t bits_per_block = size_block * 8;
+    uint32_t inodes_per_block = size_block / FS_INODE_SIZE;
+    uint32_t total = disk_blocks(super_d->param.size_disk, size_block);
+
+    super_d->super.offset = 0;
+    super_d->super.blocks = 1;
+
+    uint32_t journal_blocks = FS_JOURNAL_BLOCKS;
+    if (journal_blocks > total / 16) {
+        journal_blocks = total / 16;
+    }
+    uint32_t avail = total - super_d->super.blocks - journal_blocks;
+    uint32_t groups = (avail + FS_MAX_GROUP_BLOCKS - 1) / FS_MAX_GROUP_BLOCKS;
+    if (groups < FS_MIN_GROUPS) {
+        groups = FS_MIN_GROUPS;
+    }
+    if (avail / groups < FS_MIN_GROUP_BLOCKS) {
+        groups = 1;
+    }
+    uint32_t group_blocks = avail / groups;
+
+    // Inodes fill whole inode table blocks, and a multiple of 8 keeps the
+    // slice of every group byte aligned in the in-memory bitmap
+    uint32_t ipg = (uint32_t)((uint64_t)group_blocks * size_block / FS_BYTES_PER_INODE);
+    ipg = ROUND_UP(ipg, ROUND_UP(inodes_per_block, 8));
+    uint32_t imap_blocks = (ipg + bits_per_block - 1) / bits_per_block;
+    uint32_t inode_blocks = ipg / inodes_per_block;
+    if (super_d->log_segment != 0) {
+        inode_blocks = (ipg * sizeof(uint32_t) + size_block - 1) / size_block;
+    }
+
+    // Every dmap block covers bits_per_block data blocks besides itself,
+    // the checksum block takes one more
+    uint32_t rest = group_blocks - imap_blocks - 1 - inode_blocks;
+    uint32_t dmap_blocks = (rest + bits_per_block) / (bits_per_block + 1);
+    uint32_t dpg = ROUND_DOWN(rest - dmap_blocks, 8);
+
+    super_d->param.max_ino = groups * ipg;
+    super_d->param.max_dno = groups * dpg;
+
+    super_d->inode_size = FS_INODE_SIZE;
+    super_d->groups = groups;
+    super_d->group_blocks = group_blocks;
+    super_d->inodes_per_group = ipg;
+    super_d->blocks_per_group = dpg;
+
+    super_d->imap.offset = super_d->super.offset + super_d->super.blocks * size_block;
+    super_d->imap.blocks = imap_blocks;
+
+    super_d->dmap.offset = super_d->imap.offset + super_d->imap.blocks * size_block;
+    super_d->dmap.blocks = dmap_blocks;
+
+    super_d->csum.offset = super_d->dmap.offset + super_d->dmap.blocks * size_block;
+    super_d->csum.blocks = 1;
+
+    super_d->inodes.offset = super_d->csum.offset + super_d->csum.blocks * size_block;
+    super_d->inodes.blocks = inode_blocks;
+
+    super_d->data.offset = super_d->inodes.offset + super_d->inodes.blocks * size_block;
+    super_d->data.blocks = dpg;
+
+    // The journal follows the last group
+    super_d->journal.offset = (super_d->super.blocks + groups * group_blocks) * size_block;
+    super_d->journal.blocks = journal_blocks;
+}
+
+/**
+ * @brief Read both bitmaps the first time the allocator needs them
+ * @attention A clean mount leaves them on disk, so mounting costs the same
+ *            whatever the size of the disk and of the namespace.
+ *            A block that fails its checksum makes the filesystem read-only
+ * @return ERROR_IO once the bitmaps are known to be corrupted
+ */
+int maps_load() {
+    if (super.imap != NULL) {
+        return super.readonly ? ERROR_IO : ERROR_NONE;
+    }
+    super.imap = bitmap_init(super.params.max_ino);
+    super.dmap = bitmap_init(super.params.max_dno);
+    bitmap_sync(super.imap, super.imap_off, super.ipg, 0);
+    bitmap_sync(super.dmap, super.dmap_off, super.dpg, 0);
+    bitmap_rebuild(super.imap);
+    bitmap_rebuild(super.dmap);
+    group_rebuild();
+    if (super.csum_off == 0) {
+        return ERROR_NONE;
+    }
+
+    uint32_t* stored = (uint32_t*)malloc(super.params.size_block);
+    uint32_t* csums = (uint32_t*)malloc(super.params.size_block);
+    for (uint32_t g = 0; g < super.groups && !super.readonly; g++) {
+        disk_read(super.csum_off + (off_t)g * super.group_size, stored, super.params.size_block);
+        csum_pack(g, csums);
+        if (memcmp(stored, csums, (super.imap_blks + super.dmap_blks) * sizeof(uint32_t)) != 0) {
+            fprintf(stderr, "fs: bitmaps of group %u fail their checksum, read-only until fsck.fs\n", g);
+            super.readonly = 1;
+        }
+    }
+    free(stored);
+    free(csums);
+    return super.readonly ? ERROR_IO : ERROR_NONE;
+}
+
+/**
+ * @brief Bytes of fs_super_d covered by the checksum of a version
+ */
+static size_t super_csum_len(uint32_t version) {
+    return version >= FS_VERSION ? sizeof(struct fs_super_d) : offsetof(struct fs_super_d, log_segment);
+}
+
+/**
+ * @brief Write the in-memory super block to disk
+ */
+int super_write(uint32_t state) {
+    struct fs_super_d super_d;
+    memcpy(&super_d.param, &super.params, sizeof(DiskParam));
+    super_d.magic = FS_MAGIC;
+    super_d.version = super.version;
+    super_d.super.offset = super.super_off;
+    super_d.super.blocks = 1;
+    super_d.imap.offset = super.imap_off;
+    super_d.imap.blocks = super.imap_blks;
+    super_d.dmap.offset = super.dmap_off;
+    super_d.dmap.blocks = super.dmap_blks;
+    super_d.inodes.offset = super.inodes_off;
+    super_d.inodes.blocks = super.inodes_blks;
+    super_d.data.offset = super.data_off;
+    super_d.data.blocks = super.data_blks;
+    super_d.groups = super.groups;
+    super_d.group_blocks = super.group_size / super.params.size_block;
+    super_d.inodes_per_group = super.ipg;
+    super_d.blocks_per_group = super.dpg;
+    super_d.inode_size = super.inode_size;
+    super_d.journal.offset = super.journal_off;
+    super_d.journal.blocks = super.journal_blks;
+    super_d.state = state;
+    super_d.generation = super.generation;
+    super_d.snap_dir = super.snap_dir;
+    super_d.snap_blocks = super.snap_blks;
+    super_d.snap_generation = super.snap_generation;
+    super_d.csum.offset = super.csum_off;
+    super_d.csum.blocks = super.csum_off ? 1 : 0;
+    super_d.checksum = 0;
+    super_d.log_segment = super.log_segment;
+    super_d.log_head = super.log_head;
+    if (super.csum_off != 0) {
+        super_d.checksum = crc32c(0, &super_d, super_csum_len(super.version));
+    }
+
+    return disk_write(0, &super_d, sizeof(struct fs_super_d));
+}
+
 /**
  * @brief mount disk
  */
@@ -237,107 +1282,220 @@ int disk_mount() {
     super.params.size_block = super.params.size_io * 2;
 
     struct fs_super_d super_d;
-    disk_read(0, &super_d, sizeof(struct fs_super_d));
+    disk_read_live(0, &super_d, sizeof(struct fs_super_d));
 
     int is_init = (super_d.magic != FS_MAGIC);
+    if (fs_options.snapshot && (is_init || super_d.snap_blocks == 0)) {
+        fprintf(stderr, "fs: %s has no snapshot to mount\n", fs_options.device);
+        exit(1);
+    }
 
     // Superblock Initialization
     if (is_init) {
         // Initialize the disk
         super_d.magic = FS_MAGIC;
+        super_d.version = FS_VERSION;
 
         super_d.param.size_io = super.params.size_io;
         super_d.param.size_disk = super.params.size_disk;
         super_d.param.size_block = super.params.size_block;
         super_d.param.size_usage = 0; 
-        super_d.param.max_ino = 1000; 
-        super_d.param.max_dno = 4000; 
-        
-        super_d.super.offset = 0;
-        super_d.super.blocks = 1;
-
-        super_d.imap.offset = super_d.super.offset + super_d.super.blocks * super_d.param.size_block;
-        super_d.imap.blocks = 1;
-
-        super_d.dmap.offset = super_d.imap.offset + super_d.imap.blocks * super_d.param.size_block;
-        super_d.dmap.blocks = 1;
+        super_d.generation = 0;
+        super_d.log_segment = fs_options.log ? FS_LOG_SEGMENT : 0;
+        super_d.log_head = 0;
+        fs_geometry(&super_d);
+    }
+    else if (super_d.groups == 0) {
+        // Images without block groups are a single group spanning the disk
+        super_d.groups = 1;
+        super_d.inodes_per_group = super_d.param.max_ino;
+        super_d.blocks_per_group = super_d.param.max_dno;
+        super_d.group_blocks = 0;
+    }
 
-        super_d.inodes.offset = super_d.dmap.offset + super_d.dmap.blocks * super_d.param.size_block;
-        super_d.inodes.blocks = 64; 
-        
-        super_d.data.offset = super_d.inodes.offset + super_d.inodes.blocks * super_d.param.size_block;
-        super_d.data.blocks = 4096 - super_d.super.blocks - super_d.imap.blocks - super_d.dmap.blocks - super_d.inodes.blocks; 
+    else if (super_d.version >= FS_VERSION_V3) {
+        uint32_t checksum = super_d.checksum;
+        super_d.checksum = 0;
+        if (crc32c(0, &super_d, super_csum_len(super_d.version)) != checksum) {
+            fprintf(stderr, "fs: super block of %s fails its checksum, run fsck.fs\n", fs_options.device);
+            exit(1);
+        }
     }
 
     memcpy(&super.params, &super_d.param, sizeof(DiskParam));
+    super.disk_blks = disk_blocks(super.params.size_disk, super.params.size_block);
+    super.version = super_d.version;
+    super.csum_off = super_d.version >= FS_VERSION_V3 ? super_d.csum.offset : 0;
+    super.readonly = 0;
+    super.log_segment = super_d.version >= FS_VERSION ? super_d.log_segment : 0;
+    super.log_head = super.log_segment != 0 ? super_d.log_head : 0;
     super.super_off = super_d.super.offset;
     super.imap_off = super_d.imap.offset;
     super.dmap_off = super_d.dmap.offset;
     super.inodes_off = super_d.inodes.offset;
     super.data_off = super_d.data.offset;
+    super.imap_blks = super_d.imap.blocks;
+    super.dmap_blks = super_d.dmap.blocks;
+    super.inodes_blks = super_d.inodes.blocks;
+    super.data_blks = super_d.data.blocks;
+
+    super.groups = super_d.groups;
+    super.group_size = super_d.group_blocks * super.params.size_block;
+    super.ipg = super_d.inodes_per_group;
+    super.dpg = super_d.blocks_per_group;
+
+    // FS_VERSION_V1 records end right before fs_inode_d::flags
+    super.inode_size = super_d.inode_size ? super_d.inode_size : offsetof(struct fs_inode_d, flags);
+    super.inline_max = 0;
+    if (super.inode_size > offsetof(struct fs_inode_d, inline_data)) {
+        super.inline_max = super.inode_size - offsetof(struct fs_inode_d, inline_data);
+    }
+    if (super.csum_off != 0) {
+        super.inline_max -= sizeof(struct fs_inode_tail_d); // * The checksums end the record
+    }
+
+    // Journal Recovery, before any metadata is read
+    int is_clean = (!is_init && super_d.state == FS_STATE_CLEAN);
+    super.generation = super_d.generation + 1;
+    super.journal_off = super_d.journal.blocks ? super_d.journal.offset : 0;
+    super.journal_blks = super_d.journal.blocks;
+    if (is_init && super.journal_off != 0) {
+        journal_format(super.journal_off, super.journal_blks);
+    }
+    if (fs_options.snapshot) {
+        // * The journal belongs to the live mount, the snapshot was taken after a commit
+        is_clean = 1;
+        fprintf(stderr, "fs: mounting snapshot of generation %u read-only\n", super_d.snap_generation);
+    }
+    else if (!is_init && !is_clean) {
+        fprintf(stderr, "fs: generation %u was not unmounted cleanly, recovering\n", super_d.generation);
+    }
+    if (!fs_options.snapshot) {
+        journal_recover(); // * Only reads the sequence number after a clean umount
+    }
+    super.gd = (struct fs_group *)calloc(super.groups, sizeof(struct fs_group));
+
+    // Snapshot, its copies are made before any shared block is overwritten,
+    // so the transaction just replayed needed none
+    super.snap_dir = is_init ? 0 : super_d.snap_dir;
+    super.snap_blks = is_init ? 0 : super_d.snap_blocks;
+    super.snap_generation = is_init ? 0 : super_d.snap_generation;
+    if (super.snap_blks != 0) {
+        snap_load();
+    }
+
+    // Inode Location Table, needed to find any record in log-structured mode
+    if (super.log_segment != 0 && log_load(is_init) != ERROR_NONE) {
+        exit(1);
+    }
 
-    // Bitmap Initialization
+    // Bitmap Initialization, deferred to the first allocation after a clean umount
+    super.imap = NULL;
+    super.dmap = NULL;
     if (is_init) {
-        super.imap = bitmap_init(super.params.size_block * super_d.imap.blocks * 8);
-        super.dmap = bitmap_init(super.params.size_block * super_d.dmap.blocks * 8);
-        disk_write(super.imap_off, super.imap, sizeof (super.imap));
-        disk_write(super.dmap_off, super.dmap, sizeof (super.dmap));
-        free(super.imap);
-        free(super.dmap);
-    }
-    super.imap = bitmap_init(super.params.size_block * super_d.imap.blocks * 8);
-    super.dmap = bitmap_init(super.params.size_block * super_d.dmap.blocks * 8);
-    disk_read(super.imap_off, super.imap, sizeof(super.imap));
-    disk_read(super.dmap_off, super.dmap, sizeof(super.dmap));
+        super.imap = bitmap_init(super.params.max_ino);
+        super.dmap = bitmap_init(super.params.max_dno);
+        bitmap_sync(super.imap, super.imap_off, super.ipg, 1);
+        bitmap_sync(super.dmap, super.dmap_off, super.dpg, 1);
+        group_rebuild();
+        for (uint32_t g = 0; g < super.groups; g++) {
+            // * Every checksum block gets written by the first commit
+            super.gd[g].imap_dirty = (1u << super.imap_blks) - 1;
+            super.gd[g].dmap_dirty = (1u << super.dmap_blks) - 1;
+        }
+    }
+    else if (!is_clean) {
+        if (maps_load() == ERROR_NONE && super.snap_blks != 0) {
+            snap_recover();
+        }
+    }
 
     // Root Entry Initialization
     struct fs_dentry *root = dentry_create("/", FT_DIR);
     super.root = root;
+    if (root == NULL) {
+        fprintf(stderr, "fs: out of memory mounting %s\n", fs_options.device);
+        exit(1);
+    }
     if (is_init) {
 
         struct fs_inode *root_inode = inode_create();
+        if (root_inode == NULL) {
+            fprintf(stderr, "fs: out of memory mounting %s\n", fs_options.device);
+            exit(1);
+        }
 
-        int ino = bitmap_alloc(super.imap,super.params.max_ino);
+        int ino = ino_alloc(NULL, FT_DIR);
         root_inode->ino = ino;
 
         dentry_bind(root, root_inode);
-        root_inode->dno_dir = bitmap_alloc(super.dmap, super.params.max_dno);
-        inode_sync(root_inode);
+        uint32_t len;
+        root_inode->dno_dir = dno_alloc(dno_goal(root_inode), 1, 1, &len);
+        disk_sync();
+        inode_free(root_inode); // * Read back below like on any other mount
+    }
+    if (dentry_restore(root, 0) != ERROR_NONE) {
+        fprintf(stderr, "fs: cannot read the root of %s\n", fs_options.device);
+        exit(1);
+    }
+    if (!fs_options.snapshot) {
+        super_write(FS_STATE_DIRTY); // * A crash from now on takes the recovery path
     }
-    dentry_restore(root, 0);
 
     return ERROR_NONE;
 }
 
 /**
  * @brief Unmount the disk
+ * @attention The image is only marked clean once every dirty inode was
+ *            written back, otherwise the next mount recovers it
+ * @return the error of disk_sync
  */
 int disk_umount() {
-    inode_sync(super.root->self);
-
-    struct fs_super_d super_d;
-    memcpy(&super_d.param, &super.params, sizeof(DiskParam));
-    super_d.magic = FS_MAGIC;
-    super_d.super.offset = super.super_off;
-    super_d.super.blocks = 1;
-    super_d.imap.offset = super.imap_off;
-    super_d.imap.blocks = 1;
-    super_d.dmap.offset = super.dmap_off;
-    super_d.dmap.blocks = 1;
-    super_d.inodes.offset = super.inodes_off;
-    super_d.inodes.blocks = 64; 
-    super_d.data.offset = super.data_off;
-    super_d.data.blocks = 4029; 
+    int ret = disk_sync();
 
-    disk_write(0, &super_d, sizeof(struct fs_super_d));
+    if (ret != ERROR_NONE) {
+        fprintf(stderr, "fs: %s could not be written back, left dirty for recovery\n", fs_options.device);
+    } else if (!fs_options.snapshot) {
+        super_write(FS_STATE_CLEAN);
+    }
+    if (fs_options.stats) {
+        journal_stats();
+    }
+    journal_destroy();
+    snap_unload();
+    super.snap_blks = 0;
+    if (super.itab != NULL) {
+        if (fs_options.stats) {
+            log_stats();
+        }
+        log_unload();
+    }
+    dno_drain();
+    if (fs_options.stats) {
+        dno_stats();
+    }
+    dno_pending_free();
 
-    // Write Bitmap
-    disk_write(super.imap_off, super.imap, super.params.size_block * super_d.imap.blocks);
-    disk_write(super.dmap_off, super.dmap, super.params.size_block * super_d.dmap.blocks);
+    if (super.imap != NULL) {
+        bitmap_free(super.imap);
+        bitmap_free(super.dmap);
+        super.imap = NULL;
+        super.dmap = NULL;
+    }
+    free(super.gd);
+    super.gd = NULL;
 
-    free(super.imap);
-    free(super.dmap);
+    // Drop the In-Memory tree at once
+    if (fs_options.stats) {
+        slab_stats(&dentry_pool);
+        slab_stats(&inode_pool);
+    }
+    cache_destroy();
+    slab_destroy(&dentry_pool);
+    slab_destroy(&inode_pool);
+    super.root = NULL;
 
     ddriver_close(super.fd);
-    return ERROR_NONE;
+    return ret;
 }
\ No newline at end of file
@@ -2,13 +2,22 @@
 
 extern struct fs_super super;
 
+struct slab_pool dentry_pool = SLAB_POOL_INIT("dentry", struct fs_dentry);
+struct slab_pool inode_pool = SLAB_POOL_INIT("inode", struct fs_inode);
+
+/* Serializes restoring inodes and directories on demand, lookups run under the shared fs lock */
+static pthread_mutex_t restore_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /**
  * @brief Create an In-Memory empty dentry, no inode binded
+ * @return NULL if out of memory
  */
 struct fs_dentry* dentry_create(const char* name, FileType ftype)
 {
-    struct fs_dentry* dentry = (struct fs_dentry*)malloc(sizeof(struct fs_dentry));
+    struct fs_dentry* dentry = (struct fs_dentry*)slab_alloc(&dentry_pool);
+    if (dentry == NULL) {
+        return NULL;
+    }
     memset(dentry, 0, sizeof(struct fs_dentry));
     memcpy(dentry->name, name, strlen(name));
     dentry->ftype = ftype;
@@ -24,17 +33,23 @@ struct fs_dentry* dentry_create(const char* name, FileType ftype)
 
 /**
  * @brief Create an In-Memory empty inode, no ino assigned
+ * @return NULL if out of memory
  */
 struct fs_inode* inode_create()
 {
-    struct fs_inode* inode = (struct fs_inode*)malloc(sizeof(struct fs_inode));
+    struct fs_inode* inode = (struct fs_inode*)slab_alloc(&inode_pool);
+    if (inode == NULL) {
+        return NULL;
+    }
     memset(inode, 0, sizeof(struct fs_inode));
+    pthread_rwlock_init(&inode->lock, NULL);
 
     inode->ino = -1;
 
     inode->dir_cnt = 0;
     inode->self = NULL;
     inode->childs = NULL;
+    inode->childs_restored = 1;
     inode->dno_dir = -1;
 
     inode->size = 0;
@@ -45,6 +60,27 @@ struct fs_inode* inode_create()
     return inode;
 }
 
+/**
+ * @brief Free an In-Memory dentry, the on-disk dentry is untouched
+ */
+void dentry_free(struct fs_dentry* dentry)
+{
+    slab_free(&dentry_pool, dentry);
+}
+
+/**
+ * @brief Free an In-Memory inode, the on-disk inode is untouched
+ */
+void inode_free(struct fs_inode* inode)
+{
+    file_drop_pages(inode);
+    free(inode->inline_data);
+    cache_mark_clean(inode);
+    cache_remove(inode);
+    pthread_rwlock_destroy(&inode->lock);
+    slab_free(&inode_pool, inode);
+}
+
 /**
  * @brief Bind dentry and inode, assign inode::ino to dentry::ino
  */
@@ -58,11 +94,15 @@ void dentry_bind(struct fs_dentry* dentry, struct fs_inode* inode)
     } else {
         dentry->ino = inode->ino;
     }
+    cache_touch(inode);
+    // * Bound inodes are new, their record has never been written
+    cache_mark_dirty(inode);
 }
 
 /**
  * @brief Register a dentry to its parent dentry
- * @attention Caller should allocate data blocks for the parent dentry
+ * @attention Caller should check the record fits, and let the parent
+ *            spill to a data block if needed, by dentry_fits
  */
 void dentry_register(struct fs_dentry* dentry, struct fs_dentry* parent)
 {
@@ -77,6 +117,10 @@ void dentry_register(struct fs_dentry* dentry, struct fs_dentry* parent)
     }
 
     dentry->parent = parent;
+
+    inode->dir_cnt++;
+    inode->size += DENTRY_D_LEN(strlen(dentry->name));
+    cache_mark_dirty(inode);
 }
 
 void dentry_unregister(struct fs_dentry* dentry)
@@ -99,7 +143,30 @@ void dentry_unregister(struct fs_dentry* dentry)
     dentry->next = NULL;
     
     inode->dir_cnt--;
+    inode->size -= DENTRY_D_LEN(strlen(dentry->name));
+    cache_mark_dirty(inode);
 }
+
+/**
+ * @brief Check whether a dentry named fname fits into the directory, and
+ *        move the directory records out of the inode if they outgrow it
+ * @param leaving bytes of a record that leaves the directory in the same
+ *        operation, the source of a rename within it
+ * @return 0 if fits, else error code
+ */
+int dentry_fits(struct fs_dentry* parent, const char* fname, int leaving)
+{
+    int name_len = strlen(fname);
+    if (name_len >= MAX_NAME_LEN) {
+        return ERROR_NAMETOOLONG;
+    }
+    int size = parent->self->size - leaving + DENTRY_D_LEN(name_len);
+    if (size > super.params.size_block) {
+        return ERROR_NOSPACE;
+    }
+    return inode_alloc(parent->self, size);
+}
+
 /**
  * @brief Get the file name from path
  * @example / -> /
@@ -168,9 +235,37 @@ struct fs_dentry *dentry_get(struct fs_dentry* dentries, int index)
     return NULL;
 }
 
+/**
+ * @brief Restore the inode of dentry, and the child dentries too if childs
+ *        is set, unless they are in memory already
+ * @attention Concurrent lookups may race for the same dentry, the loser finds
+ *            the work done. dentry_restore and dentry_restore_childs publish
+ *            their result last, so the unlocked checks see complete state
+ */
+int dentry_load(struct fs_dentry* dentry, int childs)
+{
+    struct fs_inode* inode = __atomic_load_n(&dentry->self, __ATOMIC_ACQUIRE);
+    if (inode != NULL && (!childs || __atomic_load_n(&inode->childs_restored, __ATOMIC_ACQUIRE))) {
+        return ERROR_NONE;
+    }
+    int ret = ERROR_NONE;
+    pthread_mutex_lock(&restore_lock);
+    if (dentry->self == NULL) {
+        ret = dentry_restore(dentry, dentry->ino);
+    }
+    if (ret == ERROR_NONE && childs) {
+        pthread_rwlock_wrlock(&dentry->self->lock); // * fsync may be packing it
+        ret = dentry_restore_childs(dentry->self);
+        pthread_rwlock_unlock(&dentry->self->lock);
+    }
+    pthread_mutex_unlock(&restore_lock);
+    return ret;
+}
+
 /**
  * @brief Resolve path to dentry
- * @return 0 if found, and put dentry to *dentry, else put parent dentry to *dentry
+ * @return 0 if found, and put dentry to *dentry, else put parent dentry to *dentry;
+ *         ERROR_IO or ERROR_NOMEM if a dentry on the way could not be restored
  */
 int dentry_lookup(char* path, struct fs_dentry** dentry)
 {
@@ -178,63 +273,115 @@ int dentry_lookup(char* path, struct fs_dentry** dentry)
     *dentry = ptr;
 
     char *fname;
+    char *save; // * strtok keeps its position in a static, lookups run in parallel
 
     char* path_bak = strdup(path);
 
     int levels = get_path_level(path_bak);
-    fname = strtok(path_bak, "/");
+    fname = strtok_r(path_bak, "/", &save);
 
     for (int i = 0; i < levels; i++) {
+        if (ptr->ftype != FT_DIR) {
+            free(path_bak);
+            return ERROR_NOTFOUND;
+        }
+        int ret = dentry_load(ptr, 1);
+        if (ret != ERROR_NONE) {
+            free(path_bak);
+            return ret;
+        }
+        cache_touch(ptr->self);
         // Find fname in ptr's subdirecties
         ptr = dentry_find(ptr->self->childs, fname);
         if (ptr == NULL) {
+            free(path_bak);
             return ERROR_NOTFOUND;
         }
         *dentry = ptr;
-        fname = strtok(NULL, "/");
+        fname = strtok_r(NULL, "/", &save);
     }
-    if (ptr->self == NULL) {
-        dentry_restore(ptr, ptr->ino);
+    free(path_bak);
+    int ret = dentry_load(ptr, 0);
+    if (ret != ERROR_NONE) {
+        return ret;
     }
+    cache_touch(ptr->self);
     return 0;
 }
 
 /**
  * @brief Allocate data block for inode if needed
- * @attention should be called whenever new data is written to inode
+ * @param size bytes of dentry records the directory is about to hold
+ * @attention Directory records are kept inline in the inode record until
+ *            they outgrow super.inline_max, and stay in the block afterwards
  */
-void inode_alloc(struct fs_inode* inode)
+int inode_alloc(struct fs_inode* inode, int size)
 {
     struct fs_dentry* dentry = inode->self;
     if (dentry->ftype == FT_DIR) {
-        if (inode->childs == NULL && inode->dno_dir == -1) {
-            inode->dno_dir = bitmap_alloc(super.dmap, super.params.max_dno);
+        if (inode->dno_dir == -1 && size > super.inline_max) {
+            uint32_t len;
+            int dno = dno_alloc(dno_goal(inode), 1, 1, &len);
+            if (dno < 0) {
+                return ERROR_NOSPACE;
+            }
+            inode->dno_dir = dno;
+            cache_mark_dirty(inode);
         }
     }
+    return ERROR_NONE;
 }
 
 
 int dentry_delete(struct fs_dentry* dentry)
 {
+    // Load the bitmaps before anything is unlinked, the frees below then cannot fail
+    if (dentry_load(dentry, dentry->ftype == FT_DIR) != ERROR_NONE || maps_load() != ERROR_NONE) {
+        return ERROR_IO;
+    }
     dentry_unregister(dentry);
-    if (dentry->ftype == FT_REG) {
-        for (int i = 0; i < MAX_BLOCK_PER_INODE; i++) {
-            if (dentry->self->dno_reg[i] != -1) {
-                bitmap_clear(super.dmap, dentry->self->dno_reg[i]);
+    if (dentry->ftype == FT_DIR) {
+        while (dentry->self->childs != NULL) {
+            if (dentry_delete(dentry->self->childs) != ERROR_NONE) {
+                break; // * Leaks what is left, fsck.fs reclaims it
             }
         }
     }
-    if (dentry->ftype == FT_DIR) {
-        for (int i = 0; i < dentry->self->dir_cnt; i++){
-            dentry_delete(dentry->self->childs);
-        }
-        if (dentry->self->dno_dir != -1){
-            bitmap_clear(super.dmap, dentry->self->dno_dir);
+    if (__atomic_load_n(&dentry->self->nopen, __ATOMIC_RELAXED) > 0) {
+        dentry->self->unlinked = 1; // * Open handles keep using it, the last fs_release destroys it
+        return ERROR_NONE;
+    }
+    dentry_destroy(dentry);
+    return ERROR_NONE;
+}
+
+/**
+ * @brief Free the blocks, inode number, inode and dentry of a dentry already
+ *        taken out of its directory
+ */
+void dentry_destroy(struct fs_dentry* dentry)
+{
+    if (dentry->ftype == FT_REG) {
+        // Free physically contiguous blocks as one range
+        uint32_t* dno = dentry->self->dno_reg;
+        for (int i = 0; i < MAX_BLOCK_PER_INODE; ) {
+            if (dno[i] == -1) {
+                i++;
+                continue;
+            }
+            int run = 1;
+            while (i + run < MAX_BLOCK_PER_INODE && dno[i + run] == dno[i] + run) {
+                run++;
+            }
+            dno_free(dno[i], run);
+            i += run;
         }
     }
+    if (dentry->ftype == FT_DIR && dentry->self->dno_dir != -1) {
+        dno_free(dentry->self->dno_dir, 1);
+    }
 
-    bitmap_clear(super.imap, dentry->self->ino);
-    free(dentry->self);
-    free(dentry);
-    return ERROR_NONE;
+    ino_free(dentry->self->ino);
+    inode_free(dentry->self);
+    dentry_free(dentry);
 }
@@ -0,0 +1,233 @@
+#define _GNU_SOURCE
+#include "../include/fs.h"
+
+extern struct fs_super super;
+extern struct custom_options fs_options;
+
+/* Namespace lock: shared by lookups, reads and writes of file data, held
+ * exclusively by operations that change the tree or allocate, and by the
+ * flusher while it writes back. Writers are preferred so the flusher is
+ * not starved by a stream of readers. */
+static pthread_rwlock_t fs_rwlock = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+
+static struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t drained; // broadcast with lock held after each writeback
+    int running;
+    int stop;
+    int kicked;
+    int error;              // result of the last writeback, see flusher_throttle
+} flusher = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+    .drained = PTHREAD_COND_INITIALIZER,
+};
+
+/* Writer throttling, protected by flusher.lock */
+static struct {
+    uint64_t throttled; // writes delayed past the soft limit
+    uint64_t blocked;   // writes that waited at the hard limit
+    uint64_t total_us;
+    uint64_t max_us;
+} stats;
+
+void fs_lock() {
+    pthread_rwlock_wrlock(&fs_rwlock);
+}
+
+void fs_lock_shared() {
+    pthread_rwlock_rdlock(&fs_rwlock);
+}
+
+void fs_unlock() {
+    pthread_rwlock_unlock(&fs_rwlock);
+}
+
+/**
+ * @brief Pages of all files waiting for writeback, also read without fs_rwlock
+ */
+static uint32_t dirty_pages() {
+    return __atomic_load_n(&super.dirty_pages, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Whether the dirty state is too old or too large
+ * @attention Caller holds fs_rwlock exclusively
+ */
+static int flusher_due() {
+    time_t since = cache_dirty_since();
+    if (since == 0) {
+        return 0;
+    }
+    return dirty_pages() >= FS_FLUSH_PAGES || time(NULL) - since >= fs_options.commit;
+}
+
+static void flusher_drained(int error) {
+    pthread_mutex_lock(&flusher.lock);
+    flusher.error = error;
+    pthread_cond_broadcast(&flusher.drained);
+    pthread_mutex_unlock(&flusher.lock);
+}
+
+/**
+ * @brief Commit all dirty state in one transaction, clean segments in
+ *        log-structured mode when they run low, and evict inodes that
+ *        shared operations could not
+ * @attention Backs off while foreground operations hold fs_rwlock, but only
+ *            FS_FLUSH_RETRIES times so the writeback lag stays bounded
+ */
+static void flusher_run() {
+    struct timespec backoff = { 0, 1000 * 1000 };
+    int tries = 0;
+    while (pthread_rwlock_trywrlock(&fs_rwlock) != 0) {
+        if (++tries == FS_FLUSH_RETRIES) {
+            pthread_rwlock_wrlock(&fs_rwlock);
+            break;
+        }
+        nanosleep(&backoff, NULL);
+    }
+    if (flusher_due()) {
+        flusher_drained(disk_sync()); // * A failed one keeps its pages dirty for the next
+    }
+    if (log_should_clean()) {
+        log_clean();
+        flusher_drained(ERROR_NONE);
+    }
+    if (cache_over()) {
+        cache_shrink(1);
+    }
+    pthread_rwlock_unlock(&fs_rwlock);
+}
+
+static void *flusher_main(void *arg) {
+    pthread_mutex_lock(&flusher.lock);
+    while (!flusher.stop) {
+        if (!flusher.kicked) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += 1;
+            pthread_cond_timedwait(&flusher.wake, &flusher.lock, &deadline);
+        }
+        if (flusher.stop) {
+            break;
+        }
+        flusher.kicked = 0;
+        pthread_mutex_unlock(&flusher.lock);
+        flusher_run();
+        pthread_mutex_lock(&flusher.lock);
+    }
+    pthread_mutex_unlock(&flusher.lock);
+    return NULL;
+}
+
+/**
+ * @brief Start the background writeback thread after mount
+ */
+void flusher_start() {
+    flusher.stop = 0;
+    flusher.kicked = 0;
+    flusher.running = (pthread_create(&flusher.thread, NULL, flusher_main, NULL) == 0);
+}
+
+/**
+ * @brief Ask the flusher to check the thresholds now instead of at its next tick
+ */
+void flusher_kick() {
+    pthread_mutex_lock(&flusher.lock);
+    flusher.kicked = 1;
+    pthread_cond_signal(&flusher.wake);
+    pthread_mutex_unlock(&flusher.lock);
+}
+
+static uint64_t elapsed_us(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)(now.tv_sec - start->tv_sec) * 1000000 + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+/**
+ * @brief Apply backpressure to a writer before it dirties more pages
+ * @attention Past FS_DIRTY_SOFT the writer sleeps in proportion to how far
+ *            it is towards FS_DIRTY_HARD; at FS_DIRTY_HARD it waits until a
+ *            writeback brings the dirty pages back under the limit, or
+ *            fails and leaves them dirty, the write then gets the error
+ *            from its own reservation. Caller must not hold fs_rwlock
+ */
+void flusher_throttle() {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int blocked = 0;
+
+    pthread_mutex_lock(&flusher.lock);
+    while (dirty_pages() >= FS_DIRTY_HARD) {
+        blocked = 1;
+        if (!flusher.running) {
+            pthread_mutex_unlock(&flusher.lock);
+            fs_lock();
+            disk_sync();
+            fs_unlock();
+            pthread_mutex_lock(&flusher.lock);
+            break;
+        }
+        flusher.kicked = 1;
+        pthread_cond_signal(&flusher.wake);
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += 10 * 1000 * 1000; // * Recheck in case someone else wrote back
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        if (pthread_cond_timedwait(&flusher.drained, &flusher.lock, &deadline) == 0 &&
+            flusher.error != ERROR_NONE) {
+            break;
+        }
+    }
+    uint32_t dirty = dirty_pages();
+    pthread_mutex_unlock(&flusher.lock);
+
+    int throttled = 0;
+    if (dirty > FS_DIRTY_SOFT) {
+        throttled = 1;
+        flusher_kick();
+        uint64_t us = (uint64_t)FS_THROTTLE_MAX_US * (dirty - FS_DIRTY_SOFT) / (FS_DIRTY_HARD - FS_DIRTY_SOFT);
+        struct timespec pause = { us / 1000000, (us % 1000000) * 1000 };
+        nanosleep(&pause, NULL);
+    }
+    if (!blocked && !throttled) {
+        return;
+    }
+
+    uint64_t us = elapsed_us(&start);
+    pthread_mutex_lock(&flusher.lock);
+    stats.throttled += throttled;
+    stats.blocked += blocked;
+    stats.total_us += us;
+    stats.max_us = us > stats.max_us ? us : stats.max_us;
+    pthread_mutex_unlock(&flusher.lock);
+}
+
+/**
+ * @brief Stop the flusher before umount
+ * @attention Caller must not hold fs_rwlock
+ */
+void flusher_stop() {
+    if (!flusher.running) {
+        return;
+    }
+    pthread_mutex_lock(&flusher.lock);
+    flusher.stop = 1;
+    pthread_cond_signal(&flusher.wake);
+    pthread_mutex_unlock(&flusher.lock);
+    pthread_join(flusher.thread, NULL);
+    flusher.running = 0;
+
+    if (fs_options.stats) {
+        fprintf(stderr, "flusher : throttled %llu, blocked %llu, wait %llu us, max %llu us\n",
+                (unsigned long long)stats.throttled, (unsigned long long)stats.blocked,
+                (unsigned long long)stats.total_us, (unsigned long long)stats.max_us);
+    }
+    memset(&stats, 0, sizeof(stats));
+}
@@ -6,38 +6,131 @@
 * SECTION: 宏定义
 *******************************************************************************/
 #define OPTION(t, p)        { t, offsetof(struct custom_options, p), 1 }
+#define FS_RELEASE_LAST     1	/* fs_release: 已删除文件的最后一个句柄, 见fs_release_locked */
+/* 生成独占文件系统锁的操作fn_locked, 与后台写回线程及其他操作互斥 */
+#define LOCKED(fn, params, args)		\
+	static int fn##_locked params {		\
+		fs_lock();						\
+		int ret = fn args;				\
+		fs_unlock();					\
+		return ret;						\
+	}
+/* 同LOCKED, 但只共享持有, 用于不改变目录树与分配状态的操作, 可多线程并行 */
+#define LOCKED_SHARED(fn, params, args)	\
+	static int fn##_locked params {		\
+		fs_lock_shared();				\
+		int ret = fn args;				\
+		fs_unlock();					\
+		return ret;						\
+	}
+/* 同LOCKED, 但只读挂载快照时直接返回EROFS, 并在日志中为其预留空间, 用于修改文件系统的操作 */
+#define LOCKED_RW(fn, params, args)		\
+	static int fn##_locked params {		\
+		if (fs_options.snapshot || super.readonly) {	\
+			return ERROR_ROFS;			\
+		}								\
+		fs_lock();						\
+		journal_reserve(FS_OP_INODES);	\
+		int ret = fn args;				\
+		journal_unreserve(FS_OP_INODES);	\
+		fs_unlock();					\
+		return ret;						\
+	}
 
 /******************************************************************************
 * SECTION: 全局变量
 *******************************************************************************/
 static const struct fuse_opt option_spec[] = {		/* 用于FUSE文件系统解析参数 */
 	OPTION("--device=%s", device),
+	OPTION("--cache=%d", cache_size),
+	OPTION("--commit=%d", commit),
+	OPTION("--snapshot", snapshot),
+	OPTION("--log", log),
+	OPTION("--stats", stats),
 	FUSE_OPT_END
 };
 
 struct custom_options fs_options;			 /* 全局选项 */
 struct fs_super super; 
+
+LOCKED_RW(fs_mkdir, (const char* path, mode_t mode), (path, mode))
+LOCKED_SHARED(fs_getattr, (const char* path, struct stat* st), (path, st))
+LOCKED_SHARED(fs_readdir, (const char* path, void* buf, fuse_fill_dir_t filler, off_t offset,
+		struct fuse_file_info* fi), (path, buf, filler, offset, fi))
+LOCKED_RW(fs_mknod, (const char* path, mode_t mode, dev_t dev), (path, mode, dev))
+static int fs_write_locked(const char* path, const char* buf, size_t size, off_t offset,
+		struct fuse_file_info* fi) {
+	if (fs_options.snapshot || super.readonly) {
+		return ERROR_ROFS;
+	}
+	flusher_throttle();							/* 脏页过多时先等待写回 */
+	fs_lock_shared();							/* 同一文件的写由inode锁串行 */
+	journal_reserve(1);							/* 脏inode过多时先提交, 保证一次写回是一个事务 */
+	int ret = fs_write(path, buf, size, offset, fi);
+	journal_unreserve(1);
+	fs_unlock();
+	return ret;
+}
+LOCKED_SHARED(fs_read, (const char* path, char* buf, size_t size, off_t offset,
+		struct fuse_file_info* fi), (path, buf, size, offset, fi))
+LOCKED_RW(fs_utimens, (const char* path, const struct timespec tv[2]), (path, tv))
+LOCKED_RW(fs_truncate, (const char* path, off_t offset), (path, offset))
+LOCKED_RW(fs_fallocate, (const char* path, int mode, off_t offset, off_t length,
+		struct fuse_file_info* fi), (path, mode, offset, length, fi))
+LOCKED_RW(fs_unlink, (const char* path), (path))
+LOCKED_RW(fs_rmdir, (const char* path), (path))
+LOCKED_RW(fs_rename, (const char* from, const char* to), (from, to))
+LOCKED_SHARED(fs_open, (const char* path, struct fuse_file_info* fi), (path, fi))
+LOCKED_SHARED(fs_opendir, (const char* path, struct fuse_file_info* fi), (path, fi))
+/* 同LOCKED_SHARED, 但已删除文件的最后一个句柄关闭时, 独占持有后释放其空间 */
+static int fs_release_locked(const char* path, struct fuse_file_info* fi) {
+	fs_lock_shared();
+	int ret = fs_release(path, fi);
+	fs_unlock();
+	if (ret == FS_RELEASE_LAST) {
+		struct fs_inode* inode = (struct fs_inode*)(uintptr_t)fi->fh;
+		fs_lock();
+		inode->nopen = 0;
+		dentry_destroy(inode->self);
+		fs_unlock();
+		ret = ERROR_NONE;
+	}
+	return ret;
+}
+static int fs_releasedir_locked(const char* path, struct fuse_file_info* fi) {
+	return fs_release_locked(path, fi);
+}
+/* 写回时逐个持有inode锁, 并发的fsync由fsync_lock串行并合并提交 */
+LOCKED_SHARED(fs_fsync, (const char* path, int datasync, struct fuse_file_info* fi), (path, datasync, fi))
+LOCKED_SHARED(fs_fsyncdir, (const char* path, int datasync, struct fuse_file_info* fi), (path, datasync, fi))
+LOCKED_SHARED(fs_access, (const char* path, int type), (path, type))
 /******************************************************************************
 * SECTION: FUSE操作定义
 *******************************************************************************/
 static struct fuse_operations operations = {
 	.init = fs_init,						 /* mount文件系统 */		
 	.destroy = fs_destroy,				 /* umount文件系统 */
-	.mkdir = fs_mkdir,					 /* 建目录，mkdir */
-	.getattr = fs_getattr,				 /* 获取文件属性，类似stat，必须完成 */
-	.readdir = fs_readdir,				 /* 填充dentrys */
-	.mknod = fs_mknod,					 /* 创建文件，touch相关 */
-	.write = fs_write,								  	 /* 写入文件 */
-	.read = fs_read,								  	 /* 读文件 */
-	.utimens = fs_utimens,				 /* 修改时间，忽略，避免touch报错 */
-	.truncate = fs_truncate,						  		 /* 改变文件大小 */
-	.unlink = fs_unlink,							  		 /* 删除文件 */
-	.rmdir	= fs_rmdir,							  		 /* 删除目录， rm -r */
-	.rename = fs_rename,							  		 /* 重命名，mv */
-
-	.open = fs_open,							
-	.opendir = fs_opendir,
-	.access = fs_access
+	.mkdir = fs_mkdir_locked,					 /* 建目录，mkdir */
+	.getattr = fs_getattr_locked,				 /* 获取文件属性，类似stat，必须完成 */
+	.readdir = fs_readdir_locked,				 /* 填充dentrys */
+	.mknod = fs_mknod_locked,					 /* 创建文件，touch相关 */
+	.write = fs_write_locked,								  	 /* 写入文件 */
+	.read = fs_read_locked,								  	 /* 读文件 */
+	.utimens = fs_utimens_locked,				 /* 修改时间，忽略，避免touch报错 */
+	.truncate = fs_truncate_locked,						  		 /* 改变文件大小 */
+	.fallocate = fs_fallocate_locked,						  		 /* 预分配与打洞 */
+	.unlink = fs_unlink_locked,							  		 /* 删除文件 */
+	.rmdir	= fs_rmdir_locked,							  		 /* 删除目录， rm -r */
+	.rename = fs_rename_locked,							  		 /* 重命名，mv */
+
+	.open = fs_open_locked,							
+	.opendir = fs_opendir_locked,
+	.release = fs_release_locked,
+	.releasedir = fs_releasedir_locked,
+	.flush = fs_flush,
+	.fsync = fs_fsync_locked,
+	.fsyncdir = fs_fsyncdir_locked,
+	.access = fs_access_locked
 };
 /******************************************************************************
 * SECTION: 必做函数实现
@@ -49,7 +142,9 @@ static struct fuse_operations operations = {
  * @return void*
  */
 void* fs_init(struct fuse_conn_info * conn_info) {
-	return disk_mount();
+	int ret = disk_mount();
+	flusher_start();
+	return ret;
 }
 
 /**
@@ -59,32 +154,57 @@ void* fs_init(struct fuse_conn_info * conn_info) {
  * @return void
  */
 void fs_destroy(void* p) {
+	flusher_stop();
 	disk_umount();
 }
 
 /**
- * @brief 创建目录
+ * @brief 创建目录, 路径为FS_SNAP_NAME时改为创建快照
  * 
  * @param path 相对于挂载点的路径
  * @param mode 创建模式（只读？只写？），可忽略
  * @return int 0成功，否则返回对应错误号
  */
 int fs_mkdir(const char* path, mode_t mode) {
+	if (strcmp(path, FS_SNAP_NAME) == 0) {
+		return snap_create();						/* 为整个文件系统创建快照 */
+	}
+	cache_shrink(0);
 	struct fs_dentry* parent;
-	if (dentry_lookup(path, &parent) == 0) {
+	int ret = dentry_lookup(path, &parent);
+	if (ret == 0) {
 		return ERROR_EXISTS;
 	}
+	if (ret == ERROR_IO || ret == ERROR_NOMEM) {
+		return ret;									/* 元数据校验失败或内存不足 */
+	}
 	if (parent->ftype != FT_DIR) {
 		return ERROR_NOTFOUND;
 	}
+	ret = dentry_fits(parent, get_fname(path), 0);
+	if (ret != ERROR_NONE) {
+		return ret;
+	}
+	int ino = ino_alloc(parent->self, FT_DIR);
+	if (ino < 0) {
+		return ino;
+	}
 	struct fs_dentry* dir = dentry_create(get_fname(path), FT_DIR);
 	struct fs_inode* inode = inode_create();
-	inode->ino = bitmap_alloc(super.imap, super.params.max_ino);
+	if (dir == NULL || inode == NULL) {
+		if (dir != NULL) {
+			dentry_free(dir);
+		}
+		if (inode != NULL) {
+			inode_free(inode);
+		}
+		ino_free(ino);
+		return ERROR_NOMEM;
+	}
+	inode->ino = ino;
 	dentry_bind(dir, inode);
 
-	inode_alloc(parent->self);
 	dentry_register(dir, parent);
-	parent->self->dir_cnt++;
 	
 	return ERROR_NONE;
 }
@@ -97,18 +217,32 @@ int fs_mkdir(const char* path, mode_t mode) {
  * @return int 0成功，否则返回对应错误号
  */
 int fs_getattr(const char* path, struct stat * fs_stat) {
+	if (cache_over()) {
+		flusher_kick();								/* 共享锁下不能换出, 交给后台线程 */
+	}
 	struct fs_dentry* dentry;
+	if (strcmp(path, FS_SNAP_NAME) == 0 && super.snap_blks != 0 && !fs_options.snapshot) {
+		/* 快照存在时显示为空目录, 便于mkdir确认与rmdir删除 */
+		memset(fs_stat, 0, sizeof(struct stat));
+		fs_stat->st_mode = S_IFDIR | 0555;
+		fs_stat->st_nlink = 2;
+		fs_stat->st_uid = getuid();
+		fs_stat->st_gid = getgid();
+		return ERROR_NONE;
+	}
 	if (dentry_lookup(path, &dentry) != 0) {
 		return ERROR_NOTFOUND;
 	}
+	pthread_rwlock_rdlock(&dentry->self->lock);
 	if (dentry->ftype == FT_DIR) {
 		fs_stat->st_mode = S_IFDIR | FS_DEFAULT_PERM;
-		fs_stat->st_size = dentry->self->dir_cnt * sizeof(struct fs_dentry_d);
+		fs_stat->st_size = dentry->self->size;
 	}
 	if (dentry->ftype == FT_REG) {
 		fs_stat->st_mode = S_IFREG | FS_DEFAULT_PERM;
 		fs_stat->st_size = dentry->self->size;
 	}
+	pthread_rwlock_unlock(&dentry->self->lock);
 
 	fs_stat->st_nlink = 1;
 	fs_stat->st_uid 	 = getuid();
@@ -119,7 +253,7 @@ int fs_getattr(const char* path, struct stat * fs_stat) {
 
 	if (strcmp(path, "/") == 0) {
 		fs_stat->st_size	= super.params.size_usage;
-		fs_stat->st_blocks = super.params.size_disk / super.params.size_block;
+		fs_stat->st_blocks = super.disk_blks;
 		fs_stat->st_nlink  = 2;		/* !特殊，根目录link数为2 */
 	}
 	return 0;
@@ -146,10 +280,19 @@ int fs_getattr(const char* path, struct stat * fs_stat) {
 int fs_readdir(const char * path, void * buf, fuse_fill_dir_t filler, off_t offset,
 			    		 struct fuse_file_info * fi)
 {
+	if (cache_over()) {
+		flusher_kick();
+	}
 	struct fs_dentry* dentry;
 	if (dentry_lookup(path, &dentry) != 0) {
 		return ERROR_NOTFOUND;
 	}
+	if (dentry->ftype != FT_DIR) {
+		return ERROR_NOTFOUND;
+	}
+	if (dentry_load(dentry, 1) != ERROR_NONE) {
+		return ERROR_IO;
+	}
 	struct fs_dentry* dentrys = dentry->self->childs;
 	struct fs_dentry* cur = dentry_get(dentrys, offset);
 	if (cur == NULL) {
@@ -172,23 +315,47 @@ int fs_mknod(const char* path, mode_t mode, dev_t dev) {
 	if (S_ISDIR(mode)) {
 		return fs_mkdir(path, mode);
 	}
+	if (strcmp(path, FS_SNAP_NAME) == 0) {
+		return ERROR_ACCESS;						/* 保留给快照 */
+	}
+	cache_shrink(0);
 
 	struct fs_dentry* parent;
-	if (dentry_lookup(path, &parent) == 0) {
+	int ret = dentry_lookup(path, &parent);
+	if (ret == 0) {
 		return ERROR_EXISTS;
 	}
+	if (ret == ERROR_IO || ret == ERROR_NOMEM) {
+		return ret;									/* 元数据校验失败或内存不足 */
+	}
 	if (parent->ftype != FT_DIR) {
 		return ERROR_NOTFOUND;
 	}
+	ret = dentry_fits(parent, get_fname(path), 0);
+	if (ret != ERROR_NONE) {
+		return ret;
+	}
+	int ino = ino_alloc(parent->self, FT_REG);
+	if (ino < 0) {
+		return ino;
+	}
 	struct fs_dentry* new_file = dentry_create(get_fname(path), FT_REG);
 	struct fs_inode* inode = inode_create();
-	inode->ino = bitmap_alloc(super.imap, super.params.max_ino);
+	if (new_file == NULL || inode == NULL) {
+		if (new_file != NULL) {
+			dentry_free(new_file);
+		}
+		if (inode != NULL) {
+			inode_free(inode);
+		}
+		ino_free(ino);
+		return ERROR_NOMEM;
+	}
+	inode->ino = ino;
 	dentry_bind(new_file, inode);
 
-	inode_alloc(parent->self);
 	dentry_register(new_file, parent);
 
-	parent->self->dir_cnt++;
 	return ERROR_NONE;
 }
 
@@ -206,6 +373,26 @@ int fs_utimens(const char* path, const struct timespec tv[2]) {
 /******************************************************************************
 * SECTION: 选做函数实现
 *******************************************************************************/
+/**
+ * @brief 取得打开句柄对应的inode, 没有句柄时按路径查找
+ * 
+ * 句柄在rename与unlink之后仍指向同一inode, 打开期间inode不会被换出
+ * 
+ * @param path 相对于挂载点的路径
+ * @param fi 文件信息, fs_open将inode存于fi->fh
+ * @return struct fs_inode* 找不到时为NULL
+ */
+static struct fs_inode* fs_handle(const char* path, struct fuse_file_info* fi) {
+	if (fi != NULL && fi->fh != 0) {
+		return (struct fs_inode*)(uintptr_t)fi->fh;
+	}
+	struct fs_dentry* dentry;
+	if (dentry_lookup(path, &dentry) != 0) {
+		return NULL;
+	}
+	return dentry->self;
+}
+
 /**
  * @brief 写入文件
  * 
@@ -213,27 +400,39 @@ int fs_utimens(const char* path, const struct timespec tv[2]) {
  * @param buf 写入的内容
  * @param size 写入的字节数
  * @param offset 相对文件的偏移
- * @param fi 可忽略
+ * @param fi 文件信息, 见fs_handle
  * @return int 写入大小
  */
 int fs_write(const char* path, const char* buf, size_t size, off_t offset,
 		        struct fuse_file_info* fi) {
-	struct fs_dentry* file;
-	if (dentry_lookup(path, &file) != 0) {
+	struct fs_inode* inode = fs_handle(path, fi);
+	if (inode == NULL) {
 		return ERROR_NOTFOUND;
 	}
-	if (file->ftype != FT_REG) {
+	if (inode->self->ftype != FT_REG) {
 		return ERROR_ISDIR;
 	}
-	struct fs_inode* inode = file->self;
+	if (offset + size > MAX_BLOCK_PER_INODE * super.params.size_block) {
+		return ERROR_FBIG;
+	}
 
+	pthread_rwlock_wrlock(&inode->lock);
 	if (inode->size < offset) {
+		pthread_rwlock_unlock(&inode->lock);
 		return ERROR_SEEK;
 	}
-
-	file_write(inode, offset, buf, size);
+	int ret = file_write(inode, offset, buf, size);
+	if (ret != ERROR_NONE) {
+		pthread_rwlock_unlock(&inode->lock);
+		return ret;
+	}
 	
 	inode->size = offset + size > inode->size ? offset + size : inode->size;
+	cache_mark_dirty(inode);
+	pthread_rwlock_unlock(&inode->lock);
+	if (__atomic_load_n(&super.dirty_pages, __ATOMIC_RELAXED) >= FS_FLUSH_PAGES) {
+		flusher_kick();
+	}
 	return size;
 }
 
@@ -244,20 +443,28 @@ int fs_write(const char* path, const char* buf, size_t size, off_t offset,
  * @param buf 读取的内容
  * @param size 读取的字节数
  * @param offset 相对文件的偏移
- * @param fi 可忽略
+ * @param fi 文件信息, 见fs_handle
  * @return int 读取大小
  */
 int fs_read(const char* path, char* buf, size_t size, off_t offset,
 		       struct fuse_file_info* fi) {
-	struct fs_dentry* file;
-	if (dentry_lookup(path, &file) != 0) {
+	struct fs_inode* inode = fs_handle(path, fi);
+	if (inode == NULL) {
 		return ERROR_NOTFOUND;
 	}
-	if (file->ftype != FT_REG) {
+	if (inode->self->ftype != FT_REG) {
 		return ERROR_ISDIR;
 	}
-	struct fs_inode* inode = file->self;
+	pthread_rwlock_rdlock(&inode->lock);
+	if (offset >= inode->size) {
+		pthread_rwlock_unlock(&inode->lock);
+		return 0;
+	}
+	if (offset + size > inode->size) {
+		size = inode->size - offset;
+	}
 	file_read(inode, offset, buf, size);	
+	pthread_rwlock_unlock(&inode->lock);
 	return size;			   
 }
 
@@ -272,9 +479,7 @@ int fs_unlink(const char* path) {
 	if (dentry_lookup(path, &file) != 0) {
 		return ERROR_NOTFOUND;
 	}
-	dentry_delete(file);
-
-	return ERROR_NONE;
+	return dentry_delete(file);
 }
 
 /**
@@ -291,13 +496,14 @@ int fs_unlink(const char* path) {
  */
 int fs_rmdir(const char* path) {
 
+	if (strcmp(path, FS_SNAP_NAME) == 0) {
+		return snap_delete();						/* 删除快照, 释放其副本 */
+	}
 	struct fs_dentry* file;
 	if (dentry_lookup(path, &file) != 0) {
 		return ERROR_NOTFOUND;
 	}
-	dentry_delete(file);
-
-	return 0;
+	return dentry_delete(file);
 }
 
 /**
@@ -316,23 +522,35 @@ int fs_rename(const char* from, const char* to) {
 	if (strcmp(from, to) == 0) {
 		return ERROR_NONE;
 	}
+	if (strcmp(to, FS_SNAP_NAME) == 0) {
+		return ERROR_ACCESS;						/* 保留给快照 */
+	}
 
 	struct fs_dentry* parent;
-	if (dentry_lookup(to, &parent) == 0) {
+	int ret = dentry_lookup(to, &parent);
+	if (ret == 0) {
 		return ERROR_EXISTS;
 	}
-
-	dentry_unregister(from_file);
-
-	inode_alloc(parent->self);
-	dentry_register(from_file, parent);
-
-	parent->self->dir_cnt++;
+	if (ret == ERROR_IO || ret == ERROR_NOMEM) {
+		return ret;									/* 元数据校验失败或内存不足 */
+	}
 
 	char* fname = get_fname(to);
+	int leaving = 0;
+	if (from_file->parent == parent) {
+		leaving = DENTRY_D_LEN(strlen(from_file->name));	/* 同目录内改名, 原记录让出的空间可用 */
+	}
+	ret = dentry_fits(parent, fname, leaving);
+	if (ret != ERROR_NONE) {
+		return ret;
+	}
+
+	dentry_unregister(from_file);
 
 	memcpy(from_file->name, fname, strlen(fname) + 1);
 
+	dentry_register(from_file, parent);
+
 	return ERROR_NONE;
 }
 
@@ -345,6 +563,14 @@ int fs_rename(const char* from, const char* to) {
  * @return int 0成功，否则返回对应错误号
  */
 int fs_open(const char* path, struct fuse_file_info* fi) {
+	struct fs_dentry* dentry;
+	if (dentry_lookup(path, &dentry) != 0) {
+		return ERROR_NOTFOUND;
+	}
+	__atomic_add_fetch(&dentry->self->nopen, 1, __ATOMIC_RELAXED);
+	if (fi != NULL) {
+		fi->fh = (uint64_t)(uintptr_t)dentry->self;		/* 之后的读写与关闭不再查找路径 */
+	}
 	return ERROR_NONE;
 }
 
@@ -356,9 +582,90 @@ int fs_open(const char* path, struct fuse_file_info* fi) {
  * @return int 0成功，否则返回对应错误号
  */
 int fs_opendir(const char* path, struct fuse_file_info* fi) {
+	return fs_open(path, fi);
+}
+
+/**
+ * @brief 关闭文件，打开期间inode不会被换出内存
+ * 
+ * @param path 相对于挂载点的路径
+ * @param fi 文件信息, 见fs_handle
+ * @return int 0成功; 已删除文件的最后一个句柄返回FS_RELEASE_LAST且不放下该句柄,
+ *             由fs_release_locked独占持有后释放
+ */
+int fs_release(const char* path, struct fuse_file_info* fi) {
+	struct fs_inode* inode = fs_handle(path, fi);
+	if (inode == NULL) {
+		return ERROR_NONE; /* 已被删除 */
+	}
+	int nopen = __atomic_load_n(&inode->nopen, __ATOMIC_RELAXED);
+	while (nopen > 0) {
+		if (nopen == 1 && inode->unlinked) {
+			return FS_RELEASE_LAST;
+		}
+		if (__atomic_compare_exchange_n(&inode->nopen, &nopen, nopen - 1,
+				0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			break;
+		}
+	}
 	return ERROR_NONE;
 }
 
+/**
+ * @brief 关闭目录文件
+ * 
+ * @param path 相对于挂载点的路径
+ * @param fi 文件信息
+ * @return int 0成功，否则返回对应错误号
+ */
+int fs_releasedir(const char* path, struct fuse_file_info* fi) {
+	return fs_release(path, fi);
+}
+
+/**
+ * @brief 关闭文件描述符时调用，不做写回
+ * 
+ * 延迟分配的临时文件在关闭后常被立即删除，关闭时写回会让它们白白落盘；
+ * 需要持久化的程序应调用fsync
+ * 
+ * @param path 相对于挂载点的路径
+ * @param fi 文件信息
+ * @return int 0成功，否则返回对应错误号
+ */
+int fs_flush(const char* path, struct fuse_file_info* fi) {
+	return ERROR_NONE;
+}
+
+/**
+ * @brief 将文件的数据与元数据持久化
+ * 
+ * 一次提交包含所有脏inode，等待该提交的其他fsync直接返回(组提交)
+ * 
+ * @param path 相对于挂载点的路径
+ * @param datasync 非0时只需持久化数据，本文件系统没有时间戳，与0等价
+ * @param fi 文件信息
+ * @return int 0成功，否则返回对应错误号
+ */
+int fs_fsync(const char* path, int datasync, struct fuse_file_info* fi) {
+	struct fs_inode* inode = fs_handle(path, fi);
+	if (inode == NULL) {
+		return ERROR_NOTFOUND;
+	}
+	return journal_fsync(inode);
+}
+
+/**
+ * @brief 将目录项持久化
+ * 
+ * @param path 相对于挂载点的路径
+ * @param datasync 同fs_fsync
+ * @param fi 文件信息
+ * @return int 0成功，否则返回对应错误号
+ */
+int fs_fsyncdir(const char* path, int datasync, struct fuse_file_info* fi) {
+	return fs_fsync(path, datasync, fi);
+}
+
 /**
  * @brief 改变文件大小
  * 
@@ -374,12 +681,77 @@ int fs_truncate(const char* path, off_t offset) {
 	if (file->ftype != FT_REG) {
 		return ERROR_ISDIR;
 	}
+	if (offset < 0) {
+		return ERROR_INVAL;
+	}
+	if (offset > MAX_BLOCK_PER_INODE * super.params.size_block) {
+		return ERROR_FBIG;
+	}
 	struct fs_inode* inode = file->self;
+	int ret = file_truncate(inode, offset);		/* 截断时释放末尾之后的块 */
+	if (ret != ERROR_NONE) {
+		return ret;
+	}
 	inode->size = offset;
+	cache_mark_dirty(inode);
 	return ERROR_NONE;
 }
 
 
+/**
+ * @brief 预分配文件空间, 或打洞/清零文件的一段区域
+ * 
+ * @param path 相对于挂载点的路径
+ * @param mode 0或FALLOC_FL_KEEP_SIZE为预分配, 另支持FALLOC_FL_PUNCH_HOLE和FALLOC_FL_ZERO_RANGE
+ * @param offset 区域起始偏移
+ * @param length 区域长度
+ * @param fi 可忽略
+ * @return int 0成功，否则返回对应错误号
+ */
+int fs_fallocate(const char* path, int mode, off_t offset, off_t length,
+				 struct fuse_file_info* fi) {
+	struct fs_dentry* file;
+	if (dentry_lookup(path, &file) != 0) {
+		return ERROR_NOTFOUND;
+	}
+	if (file->ftype != FT_REG) {
+		return ERROR_ISDIR;
+	}
+	if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE)) {
+		return ERROR_OPNOTSUPP;
+	}
+	if ((mode & FALLOC_FL_PUNCH_HOLE) &&
+		(!(mode & FALLOC_FL_KEEP_SIZE) || (mode & FALLOC_FL_ZERO_RANGE))) {
+		return ERROR_INVAL; /* 打洞必须保持文件大小 */
+	}
+	if (offset < 0 || length <= 0) {
+		return ERROR_INVAL;
+	}
+	struct fs_inode* inode = file->self;
+	if (mode & FALLOC_FL_PUNCH_HOLE) {
+		/* 文件末尾之后没有数据, 无需打洞 */
+		if (offset >= inode->size) {
+			return ERROR_NONE;
+		}
+		if (offset + length > inode->size) {
+			length = inode->size - offset;
+		}
+	}
+	else if (offset + length > MAX_BLOCK_PER_INODE * super.params.size_block) {
+		return ERROR_FBIG;
+	}
+
+	int ret = file_fallocate(inode, mode, offset, length);
+	if (ret != ERROR_NONE) {
+		return ret;
+	}
+	if (!(mode & FALLOC_FL_KEEP_SIZE) && offset + length > inode->size) {
+		inode->size = offset + length;
+	}
+	cache_mark_dirty(inode);
+	return ERROR_NONE;
+}
+
 /**
  * @brief 访问文件，因为读写文件时需要查看权限
  * 
@@ -416,6 +788,8 @@ int main(int argc, char **argv)
 	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 
 	fs_options.device = strdup("/home/cauchy/ddriver");
+	fs_options.cache_size = FS_DEFAULT_CACHE;
+	fs_options.commit = FS_DEFAULT_COMMIT;
 
 	if (fuse_opt_parse(&args, &fs_options, option_spec, NULL) == -1)
 		return -1;
@@ -423,4 +797,4 @@ int main(int argc, char **argv)
 	ret = fuse_main(args.argc, args.argv, &operations, NULL);
 	fuse_opt_free_args(&args);
 	return ret;
-}
\ No newline at end of file
+}
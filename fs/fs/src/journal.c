@@ -0,0 +1,331 @@
+#include "../include/fs.h"
+
+extern struct fs_super super;
+extern struct custom_options fs_options;
+
+/**
+ * The running transaction: block images in the order they were first
+ * written, stored right after room for the header block so that the whole
+ * transaction goes to the journal in one I/O.
+ */
+static struct {
+    int active;
+    uint32_t n;
+    uint32_t cap;
+    uint32_t *blocknr;
+    uint8_t *buf; // header block + n images
+} txn;
+
+/**
+ * fsync callers serialize on fsync_lock. Whoever gets it while its inode is
+ * still dirty commits every dirty inode at once; callers queued behind that
+ * commit find their inode clean and return without any I/O.
+ */
+static pthread_mutex_t fsync_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct {
+    uint64_t commits;
+    uint64_t fsyncs;
+    uint64_t coalesced;
+    uint64_t reserved; // syncs forced so the dirty set fits one transaction
+} stats;
+
+/* Inodes the running operations may still dirty, protected by fsync_lock */
+static uint32_t pending;
+
+/**
+ * @brief Checksum of a transaction, CRC32C since FS_VERSION 3 and FNV-1a before
+ */
+static uint32_t journal_checksum(const uint8_t *data, size_t len) {
+    if (super.csum_off != 0) {
+        return crc32c(0, data, len);
+    }
+    uint32_t hash = 0x811c9dc5u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * @brief Most block images one transaction can hold
+ */
+static uint32_t journal_capacity() {
+    uint32_t by_header = (super.params.size_block - sizeof(struct fs_journal_txn_d)) / sizeof(uint32_t);
+    uint32_t by_region = super.journal_blks - 2; // super block of the journal and the header
+    return by_header < by_region ? by_header : by_region;
+}
+
+/**
+ * @brief Most dirty inodes one sync can commit as a single transaction
+ * @attention A dirty inode takes at most its itab block and its directory
+ *            block. Every bitmap, checksum and log itab block may change
+ *            besides, whatever the number of inodes
+ */
+static uint32_t journal_room() {
+    uint32_t fixed = super.groups * (super.imap_blks + super.dmap_blks);
+    if (super.csum_off != 0) {
+        fixed += super.groups;
+    }
+    if (super.itab != NULL) {
+        fixed += super.groups * super.inodes_blks;
+    }
+    uint32_t cap = journal_capacity();
+    return cap > fixed + 2 ? (cap - fixed) / 2 : 1;
+}
+
+/**
+ * @brief Write an empty journal at format time
+ */
+int journal_format(off_t off, uint32_t blks) {
+    struct fs_journal_d journal_d;
+    journal_d.magic = FS_JOURNAL_MAGIC;
+    journal_d.sequence = 1;
+    disk_write(off, &journal_d, sizeof(struct fs_journal_d));
+    return ERROR_NONE;
+}
+
+/**
+ * @brief Replay the last committed transaction if it was not checkpointed
+ * @attention Must run at mount before any metadata is read
+ */
+int journal_recover() {
+    int size_block = super.params.size_block;
+    struct fs_journal_d journal_d;
+
+    if (super.journal_off == 0) {
+        return ERROR_NONE;
+    }
+    disk_read(super.journal_off, &journal_d, sizeof(struct fs_journal_d));
+    if (journal_d.magic != FS_JOURNAL_MAGIC) {
+        return ERROR_IO;
+    }
+    super.journal_seq = journal_d.sequence;
+
+    struct fs_journal_txn_d header;
+    disk_read(super.journal_off + size_block, &header, sizeof(struct fs_journal_txn_d));
+    if (header.magic != FS_JOURNAL_MAGIC || header.sequence != journal_d.sequence ||
+        header.nblocks == 0 || header.nblocks > journal_capacity()) {
+        return ERROR_NONE; // * Clean, the last transaction was checkpointed
+    }
+
+    uint8_t *buf = (uint8_t *)malloc((size_t)(header.nblocks + 1) * size_block);
+    disk_read(super.journal_off + size_block, buf, (header.nblocks + 1) * size_block);
+    struct fs_journal_txn_d *txn_d = (struct fs_journal_txn_d *)buf;
+    uint32_t checksum = txn_d->checksum;
+    txn_d->checksum = 0;
+    if (journal_checksum(buf, (size_t)(header.nblocks + 1) * size_block) != checksum) {
+        free(buf); // * Torn write, the transaction never committed
+        return ERROR_NONE;
+    }
+
+    for (uint32_t i = 0; i < txn_d->nblocks; i++) {
+        disk_write((off_t)txn_d->blocknr[i] * size_block, buf + (i + 1) * size_block, size_block);
+    }
+    fprintf(stderr, "journal: replayed transaction %u, %u blocks\n", txn_d->sequence, txn_d->nblocks);
+    free(buf);
+
+    journal_d.sequence++;
+    disk_write(super.journal_off, &journal_d, sizeof(struct fs_journal_d));
+    super.journal_seq = journal_d.sequence;
+    return ERROR_NONE;
+}
+
+/**
+ * @brief Start collecting metadata writes into one transaction
+ */
+void journal_begin() {
+    txn.active = (super.journal_off != 0);
+    txn.n = 0;
+}
+
+/**
+ * @brief Write metadata, through the running transaction if there is one
+ * @attention Blocks written twice in a transaction are logged once with
+ *            their final content
+ */
+int journal_write(off_t offset, void *in_content, int size) {
+    int size_block = super.params.size_block;
+    if (!txn.active) {
+        return disk_write(offset, in_content, size);
+    }
+
+    uint8_t *src = (uint8_t *)in_content;
+    off_t end = offset + size;
+    for (off_t blk_off = BLK_ROUND_DOWN(offset); blk_off < end; blk_off += size_block) {
+        uint32_t blocknr = blk_off / size_block;
+        uint32_t i = 0;
+        while (i < txn.n && txn.blocknr[i] != blocknr) {
+            i++;
+        }
+        if (i == txn.n) {
+            if (txn.n == journal_capacity()) {
+                // * Not reached while journal_reserve bounds the dirty set,
+                //   a last resort that gives up atomicity over losing writes
+                journal_commit();
+                txn.active = 1;
+                i = 0;
+            }
+            if (txn.n == txn.cap) {
+                txn.cap = txn.cap ? txn.cap * 2 : 16;
+                txn.blocknr = (uint32_t *)realloc(txn.blocknr, txn.cap * sizeof(uint32_t));
+                txn.buf = (uint8_t *)realloc(txn.buf, (size_t)(txn.cap + 1) * size_block);
+            }
+            txn.blocknr[i] = blocknr;
+            txn.n++;
+            off_t from = offset > blk_off ? offset : blk_off;
+            off_t to = end < blk_off + size_block ? end : blk_off + size_block;
+            if (from != blk_off || to != blk_off + size_block) {
+                disk_read(blk_off, txn.buf + (size_t)(i + 1) * size_block, size_block);
+            }
+        }
+        off_t from = offset > blk_off ? offset : blk_off;
+        off_t to = end < blk_off + size_block ? end : blk_off + size_block;
+        memcpy(txn.buf + (size_t)(i + 1) * size_block + (from - blk_off), src + (from - offset), to - from);
+    }
+    return ERROR_NONE;
+}
+
+/**
+ * @brief Copy every block of the running transaction a snapshot still shares
+ * @return number of blocks copied, each copy dirties the data bitmap
+ * @attention Done before the transaction reaches the journal, so replaying it
+ *            never overwrites a block the snapshot needs
+ */
+int journal_preserve() {
+    int copied = 0;
+    for (uint32_t i = 0; i < txn.n; i++) {
+        copied += snap_cow(txn.blocknr[i]);
+    }
+    return copied;
+}
+
+static int blocknr_cmp(const void *a, const void *b) {
+    uint32_t x = **(uint32_t **)a, y = **(uint32_t **)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Commit the running transaction and checkpoint it
+ * @attention The transaction is written to the journal with one sequential
+ *            I/O, then its blocks are written home, merging adjacent ones,
+ *            and finally the journal is marked empty again
+ */
+int journal_commit() {
+    int size_block = super.params.size_block;
+    if (!txn.active || txn.n == 0) {
+        txn.active = 0;
+        dno_commit();
+        return ERROR_NONE;
+    }
+
+    journal_preserve(); // * Normally done by the caller, unless the transaction filled up
+    struct fs_journal_txn_d *txn_d = (struct fs_journal_txn_d *)txn.buf;
+    memset(txn.buf, 0, size_block);
+    txn_d->magic = FS_JOURNAL_MAGIC;
+    txn_d->sequence = super.journal_seq;
+    txn_d->nblocks = txn.n;
+    memcpy(txn_d->blocknr, txn.blocknr, txn.n * sizeof(uint32_t));
+    txn_d->checksum = journal_checksum(txn.buf, (size_t)(txn.n + 1) * size_block);
+    disk_write(super.journal_off + size_block, txn.buf, (txn.n + 1) * size_block);
+
+    // Checkpoint in block order
+    uint32_t **order = (uint32_t **)malloc(txn.n * sizeof(uint32_t *));
+    for (uint32_t i = 0; i < txn.n; i++) {
+        order[i] = &txn.blocknr[i];
+    }
+    qsort(order, txn.n, sizeof(uint32_t *), blocknr_cmp);
+    uint8_t *run_buf = (uint8_t *)malloc((size_t)txn.n * size_block);
+    for (uint32_t i = 0; i < txn.n; ) {
+        uint32_t run = 0;
+        do {
+            uint32_t idx = order[i + run] - txn.blocknr;
+            memcpy(run_buf + (size_t)run * size_block, txn.buf + (size_t)(idx + 1) * size_block, size_block);
+            run++;
+        } while (i + run < txn.n && *order[i + run] == *order[i] + run);
+        disk_write((off_t)*order[i] * size_block, run_buf, run * size_block);
+        i += run;
+    }
+    free(run_buf);
+    free(order);
+
+    struct fs_journal_d journal_d;
+    journal_d.magic = FS_JOURNAL_MAGIC;
+    journal_d.sequence = ++super.journal_seq;
+    disk_write(super.journal_off, &journal_d, sizeof(struct fs_journal_d));
+
+    txn.n = 0;
+    txn.active = 0;
+    stats.commits++;
+    dno_commit();
+    return ERROR_NONE;
+}
+
+/**
+ * @brief Make inode and everything it depends on durable
+ * @attention The whole dirty list goes into one transaction, so concurrent
+ *            fsyncs of other inodes are absorbed by the same commit
+ */
+int journal_fsync(struct fs_inode *inode) {
+    pthread_mutex_lock(&fsync_lock);
+    stats.fsyncs++;
+    if (!cache_is_dirty(inode)) {
+        stats.coalesced++; // * Committed while we were waiting, or never dirtied
+        pthread_mutex_unlock(&fsync_lock);
+        return ERROR_NONE;
+    }
+    int ret = disk_sync();
+    pthread_mutex_unlock(&fsync_lock);
+    return ret;
+}
+
+/**
+ * @brief Make room for an operation that dirties up to inodes inodes
+ * @attention Syncs first when the dirty list could otherwise outgrow one
+ *            transaction, so that every sync commits as a whole. Caller
+ *            holds fs_rwlock, shared or exclusive, and no inode lock, and
+ *            calls journal_unreserve once the operation is done
+ */
+void journal_reserve(uint32_t inodes) {
+    if (super.journal_off == 0) {
+        return;
+    }
+    pthread_mutex_lock(&fsync_lock);
+    if (cache_dirty_count() + pending + inodes > journal_room()) {
+        stats.reserved++;
+        disk_sync(); // * Errors stay with the inodes, the flusher or fsync reports them
+    }
+    pending += inodes;
+    pthread_mutex_unlock(&fsync_lock);
+}
+
+/**
+ * @brief Give back the room taken by journal_reserve
+ */
+void journal_unreserve(uint32_t inodes) {
+    if (super.journal_off == 0) {
+        return;
+    }
+    pthread_mutex_lock(&fsync_lock);
+    pending -= inodes;
+    pthread_mutex_unlock(&fsync_lock);
+}
+
+/**
+ * @brief Print the commit counters
+ */
+void journal_stats() {
+    fprintf(stderr, "journal : commits %llu, fsyncs %llu, coalesced %llu, reserved %llu\n",
+            (unsigned long long)stats.commits, (unsigned long long)stats.fsyncs,
+            (unsigned long long)stats.coalesced, (unsigned long long)stats.reserved);
+}
+
+/**
+ * @brief Release the transaction buffers at umount
+ */
+void journal_destroy() {
+    free(txn.blocknr);
+    free(txn.buf);
+    memset(&txn, 0, sizeof(txn));
+    memset(&stats, 0, sizeof(stats));
+}
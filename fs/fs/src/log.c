@@ -0,0 +1,671 @@
+#include "../include/fs.h"
+
+extern struct fs_super super;
+extern struct custom_options fs_options;
+
+#define LOG_NONE 0xffffffffu // itab entry of an inode without a record
+
+/**
+ * Log-structured mode, chosen with --log at format.
+ *
+ * Data blocks, directory blocks and inode records are never overwritten in
+ * place once committed: every writeback appends them at super.log_head, so
+ * random overwrites turn into sequential writes. The disk is cut into
+ * segments of FS_LOG_SEGMENT blocks inside each group, the head fills one
+ * segment and then moves to the next clean one.
+ *
+ * Inode records are packed into data blocks, super.itab holds the address
+ * dno * per_block + slot of each of them and is kept in the inode units of
+ * the groups, journaled like the bitmaps. live counts the records of the
+ * itab in each block, a record block is freed when it drops to 0.
+ *
+ * Blocks freed since the last commit are never reused before it, a crash
+ * hands them back to their old owner.
+ */
+static struct {
+    uint32_t per_block;  // inode records per block
+    uint8_t *live;       // itab entries pointing into each data block
+    uint32_t spg;        // segments per group, the last one may be short
+    uint32_t victims[FS_LOG_CLEAN_BATCH]; // segments being cleaned, never allocated from
+    int nvictims;
+
+    uint64_t appended;   // blocks allocated at the head
+    uint64_t filled;     // blocks allocated from holes with no clean segment left
+    uint64_t cleaned;    // segments reclaimed
+    uint64_t moved;      // live blocks copied by the cleaner
+    uint64_t relogged;   // records rewritten by the cleaner
+} lfs;
+
+/**
+ * @brief Bytes of block k of group g's slice of the itab
+ */
+static uint32_t itab_len(uint32_t k) {
+    uint32_t slice = super.ipg * sizeof(uint32_t);
+    uint32_t size_block = super.params.size_block;
+    return slice - k * size_block < size_block ? slice - k * size_block : size_block;
+}
+
+static uint8_t *itab_block(uint32_t g, uint32_t k) {
+    return (uint8_t *)(super.itab + (size_t)g * super.ipg) + k * super.params.size_block;
+}
+
+static void itab_mark(uint32_t ino) {
+    super.gd[INO_GROUP(ino)].itab_dirty |= 1u << ((ino % super.ipg) * sizeof(uint32_t) / super.params.size_block);
+}
+
+static uint32_t seg_count() {
+    return super.groups * lfs.spg;
+}
+
+static uint32_t seg_of(uint32_t dno) {
+    return DNO_GROUP(dno) * lfs.spg + (dno % super.dpg) / super.log_segment;
+}
+
+static uint32_t seg_start(uint32_t s) {
+    return (s / lfs.spg) * super.dpg + (s % lfs.spg) * super.log_segment;
+}
+
+static uint32_t seg_end(uint32_t s) {
+    uint32_t end = seg_start(s) + super.log_segment;
+    uint32_t group_end = (s / lfs.spg + 1) * super.dpg;
+    return end < group_end ? end : group_end;
+}
+
+static int seg_victim(uint32_t s) {
+    for (int i = 0; i < lfs.nvictims; i++) {
+        if (lfs.victims[i] == s) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Whether segment s is entirely free, frees not yet committed excluded
+ */
+static int seg_clean(uint32_t s) {
+    uint32_t start = seg_start(s), end = seg_end(s);
+    if (bitmap_count_zero(super.dmap, start, end) != end - start || seg_victim(s)) {
+        return 0;
+    }
+    for (uint32_t dno = start; dno < end; dno++) {
+        if (dno_freed(dno)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief Length of the run of reusable blocks at dno, at most want and
+ *        ending before end
+ */
+static uint32_t run_at(uint32_t dno, uint32_t end, uint32_t want) {
+    uint32_t run = 0;
+    while (dno + run < end && run < want && !bitmap_test(super.dmap, dno + run) && !dno_freed(dno + run)) {
+        run++;
+    }
+    return run;
+}
+
+/**
+ * @brief Load the itab at mount, or create an empty one at format
+ * @return ERROR_IO if a block of it fails its checksum
+ */
+int log_load(int is_init) {
+    uint32_t size_block = super.params.size_block;
+    lfs.per_block = size_block / super.inode_size;
+    lfs.spg = (super.dpg + super.log_segment - 1) / super.log_segment;
+    super.itab = (uint32_t *)malloc((size_t)super.params.max_ino * sizeof(uint32_t));
+    lfs.live = (uint8_t *)calloc(super.params.max_dno, sizeof(uint8_t));
+
+    if (is_init) {
+        memset(super.itab, 0xff, (size_t)super.params.max_ino * sizeof(uint32_t));
+        for (uint32_t g = 0; g < super.groups; g++) {
+            super.gd[g].itab_dirty = (1u << super.inodes_blks) - 1;
+        }
+        return ERROR_NONE;
+    }
+
+    uint32_t *stored = (uint32_t *)malloc(size_block);
+    int ret = ERROR_NONE;
+    for (uint32_t g = 0; g < super.groups && ret == ERROR_NONE; g++) {
+        disk_read(super.inodes_off + (off_t)g * super.group_size, super.itab + (size_t)g * super.ipg,
+                  super.ipg * sizeof(uint32_t));
+        if (super.csum_off == 0) {
+            continue;
+        }
+        disk_read(super.csum_off + (off_t)g * super.group_size, stored, size_block);
+        for (uint32_t k = 0; k < super.inodes_blks; k++) {
+            if (stored[super.imap_blks + super.dmap_blks + k] != log_itab_csum(g, k)) {
+                fprintf(stderr, "fs: inode table of group %u fails its checksum, run fsck.fs\n", g);
+                ret = ERROR_IO;
+                break;
+            }
+        }
+    }
+    free(stored);
+
+    for (uint32_t ino = 0; ino < super.params.max_ino && ret == ERROR_NONE; ino++) {
+        uint32_t entry = super.itab[ino];
+        if (entry == LOG_NONE) {
+            continue;
+        }
+        if (entry / lfs.per_block >= super.params.max_dno) {
+            fprintf(stderr, "fs: inode %u lies outside the disk, run fsck.fs\n", ino);
+            ret = ERROR_IO;
+            break;
+        }
+        lfs.live[entry / lfs.per_block]++;
+    }
+    return ret;
+}
+
+/**
+ * @brief Release the itab and reset the counters at umount
+ */
+void log_unload() {
+    free(super.itab);
+    free(lfs.live);
+    super.itab = NULL;
+    lfs.live = NULL;
+    lfs.appended = lfs.filled = lfs.cleaned = lfs.moved = lfs.relogged = 0;
+}
+
+/**
+ * @brief CRC32C of block k of group g's itab slice, stored after the
+ *        bitmap checksums in the group's checksum block
+ */
+uint32_t log_itab_csum(uint32_t g, uint32_t k) {
+    return crc32c(0, itab_block(g, k), itab_len(k));
+}
+
+/**
+ * @brief Log the blocks of group g's itab changed since the last sync
+ */
+void log_journal_itab(uint32_t g) {
+    uint32_t mask = super.gd[g].itab_dirty;
+    for (uint32_t k = 0; mask != 0; k++, mask >>= 1) {
+        if (mask & 1) {
+            journal_write(super.inodes_off + (off_t)g * super.group_size + (off_t)k * super.params.size_block,
+                          itab_block(g, k), itab_len(k));
+        }
+    }
+    super.gd[g].itab_dirty = 0;
+}
+
+/**
+ * @brief Pick a run of blocks for the log and mark them in the data bitmap
+ * @attention The run continues at the head inside its segment, or starts a
+ *            clean one. With no clean segment left holes are filled, and the
+ *            flusher is kicked so the cleaner makes new segments.
+ * @return first block of the run, -1 if no run of min blocks is free
+ */
+int log_alloc(uint32_t want, uint32_t min, uint32_t *len) {
+    uint32_t nsegs = seg_count();
+    uint32_t head = super.log_head < super.params.max_dno ? super.log_head : 0;
+    uint32_t s = seg_of(head);
+    uint32_t run = seg_victim(s) ? 0 : run_at(head, seg_end(s), want);
+
+    for (uint32_t i = 1; run < min && i <= nsegs; i++) {
+        uint32_t next = (s + i) % nsegs;
+        if (seg_clean(next)) {
+            head = seg_start(next);
+            run = run_at(head, seg_end(next), want);
+        }
+    }
+    if (run >= min) {
+        lfs.appended += run;
+    } else {
+        flusher_kick();
+        for (uint32_t i = 0; run < min && i < nsegs; i++) {
+            uint32_t next = (s + i) % nsegs;
+            uint32_t end = seg_end(next);
+            if (seg_victim(next) || bitmap_count_zero(super.dmap, seg_start(next), end) < min) {
+                continue;
+            }
+            for (head = seg_start(next); head < end; head += run + 1) {
+                run = run_at(head, end, want);
+                if (run >= min) {
+                    break;
+                }
+            }
+        }
+        if (run < min) {
+            return -1;
+        }
+        lfs.filled += run;
+    }
+
+    bitmap_set_range(super.dmap, head, run);
+    super.log_head = head + run;
+    *len = run;
+    return head;
+}
+
+/**
+ * @brief Offset of the record of ino, -1 if it has none
+ */
+off_t log_inode_off(uint32_t ino) {
+    uint32_t entry = super.itab[ino];
+    if (entry == LOG_NONE) {
+        return -1;
+    }
+    return DATA_OFF(entry / lfs.per_block) + (off_t)(entry % lfs.per_block) * super.inode_size;
+}
+
+/**
+ * @brief Point the itab entry of ino to entry, freeing the block of the old
+ *        record once nothing lives in it
+ */
+static void itab_set(uint32_t ino, uint32_t entry) {
+    uint32_t old = super.itab[ino];
+    if (old != LOG_NONE && --lfs.live[old / lfs.per_block] == 0) {
+        dno_free(old / lfs.per_block, 1);
+    }
+    super.itab[ino] = entry;
+    if (entry != LOG_NONE) {
+        lfs.live[entry / lfs.per_block]++;
+    }
+    itab_mark(ino);
+}
+
+/**
+ * @brief Append n packed records to the log and point the itab to them
+ * @param records n records of super.inode_size bytes, for inos in order
+ * @return number of records written, the rest found no room
+ * @attention The record blocks are new, so they are written directly;
+ *            only the itab goes through the journal
+ */
+int log_write_inodes(const uint32_t *inos, uint8_t *records, int n) {
+    uint32_t size_block = super.params.size_block;
+    uint8_t *buf = NULL;
+    int done = 0;
+    while (done < n) {
+        uint32_t len;
+        int dno = dno_alloc_meta(super.log_head, (n - done + lfs.per_block - 1) / lfs.per_block, &len);
+        if (dno < 0) {
+            break;
+        }
+        buf = (uint8_t *)realloc(buf, (size_t)len * size_block);
+        memset(buf, 0, (size_t)len * size_block);
+        for (uint32_t i = 0; i < len * lfs.per_block && done < n; i++, done++) {
+            memcpy(buf + (size_t)i * super.inode_size, records + (size_t)done * super.inode_size, super.inode_size);
+            itab_set(inos[done], dno * lfs.per_block + i);
+        }
+        disk_write(DATA_OFF(dno), buf, len * size_block);
+    }
+    free(buf);
+    return done;
+}
+
+/**
+ * @brief Drop the record of a freed inode
+ */
+void log_forget(uint32_t ino) {
+    if (super.itab[ino] != LOG_NONE) {
+        itab_set(ino, LOG_NONE);
+    }
+}
+
+/**
+ * @brief Whether clean segments run low while enough space is scattered in
+ *        holes to make at least one more
+ * @attention Nothing is cleaned while a snapshot exists, every block moved
+ *            would be copied for it first
+ */
+int log_should_clean() {
+    if (super.itab == NULL || super.dmap == NULL || super.readonly || fs_options.snapshot ||
+        super.snap_blks != 0) {
+        return 0;
+    }
+    uint32_t clean = 0, clean_blocks = 0;
+    for (uint32_t s = 0; s < seg_count() && clean < FS_LOG_CLEAN_LOW; s++) {
+        if (seg_clean(s)) {
+            clean++;
+            clean_blocks += seg_end(s) - seg_start(s);
+        }
+    }
+    return clean < FS_LOG_CLEAN_LOW && super.dmap->free >= clean_blocks + super.log_segment;
+}
+
+/**
+ * A live block of a victim segment and where its pointer lives: in a
+ * resident inode, or in a record read from disk that gets logged again
+ */
+struct log_move {
+    uint32_t dno;
+    uint32_t to;
+    struct fs_inode *inode;
+    int rec;  // index in the relogged records when inode is NULL
+    int slot; // index in dno_reg, or MAX_BLOCK_PER_INODE for dno_dir
+};
+
+struct log_scan {
+    struct log_move *moves;
+    int nmoves;
+    int cap;
+    uint64_t *resident; // inos handled through their In-Memory inode
+};
+
+static int victim_of(uint32_t dno) {
+    return dno < super.params.max_dno && seg_victim(seg_of(dno));
+}
+
+static void scan_add(struct log_scan *scan, uint32_t dno, struct fs_inode *inode, int rec, int slot) {
+    if (scan->nmoves == scan->cap) {
+        scan->cap = scan->cap ? scan->cap * 2 : 64;
+        scan->moves = (struct log_move *)realloc(scan->moves, scan->cap * sizeof(struct log_move));
+    }
+    struct log_move *move = &scan->moves[scan->nmoves++];
+    move->dno = dno;
+    move->inode = inode;
+    move->rec = rec;
+    move->slot = slot;
+}
+
+/**
+ * @brief cache_walk callback, collect the blocks of a resident inode
+ */
+static void scan_resident(struct fs_inode *inode, void *arg) {
+    struct log_scan *scan = (struct log_scan *)arg;
+    if (!bitmap_test(super.imap, inode->ino)) {
+        return;
+    }
+    scan->resident[inode->ino / 64] |= (uint64_t)1 << (inode->ino % 64);
+    for (int i = 0; i < MAX_BLOCK_PER_INODE; i++) {
+        if (inode->dno_reg[i] != -1 && victim_of(inode->dno_reg[i])) {
+            scan_add(scan, inode->dno_reg[i], inode, -1, i);
+        }
+    }
+    if (inode->dno_dir != -1 && victim_of(inode->dno_dir)) {
+        scan_add(scan, inode->dno_dir, inode, -1, MAX_BLOCK_PER_INODE);
+    }
+    uint32_t entry = super.itab[inode->ino];
+    if (entry != LOG_NONE && victim_of(entry / lfs.per_block)) {
+        cache_mark_dirty(inode); // * The writeback at the end of the cleaning moves its record
+    }
+}
+
+static int entry_cmp(const void *a, const void *b) {
+    uint32_t x = super.itab[*(const uint32_t *)a], y = super.itab[*(const uint32_t *)b];
+    return (x > y) - (x < y);
+}
+
+static uint32_t *record_ptr(uint8_t *record, int slot) {
+    struct fs_inode_d *inode_d = (struct fs_inode_d *)record;
+    return slot == MAX_BLOCK_PER_INODE ? &inode_d->dno_dir : &inode_d->dno_reg[slot];
+}
+
+/**
+ * @brief Read the records of inodes that are not resident, block by block,
+ *        and keep those that point into or live in a victim segment
+ * @return ERROR_IO if a record fails its checksum, nothing is moved then
+ */
+static int scan_records(struct log_scan *scan, uint32_t **inos, uint8_t **records, int *n) {
+    uint32_t size_block = super.params.size_block;
+    uint32_t cnt = 0;
+    uint32_t *order = (uint32_t *)malloc(((size_t)super.params.max_ino + 1) * sizeof(uint32_t));
+    for (uint32_t ino = 0; ino < super.params.max_ino; ino++) {
+        if (bitmap_test(super.imap, ino) && super.itab[ino] != LOG_NONE &&
+            !((scan->resident[ino / 64] >> (ino % 64)) & 1)) {
+            order[cnt++] = ino;
+        }
+    }
+    qsort(order, cnt, sizeof(uint32_t), entry_cmp);
+
+    uint8_t *blk = (uint8_t *)malloc(size_block);
+    uint32_t loaded = LOG_NONE;
+    int ret = ERROR_NONE;
+    for (uint32_t i = 0; i < cnt && ret == ERROR_NONE; i++) {
+        uint32_t entry = super.itab[order[i]];
+        if (entry / lfs.per_block != loaded) {
+            loaded = entry / lfs.per_block;
+            disk_read(DATA_OFF(loaded), blk, size_block);
+        }
+        uint8_t *record = blk + (entry % lfs.per_block) * super.inode_size;
+        if (super.csum_off != 0) {
+            struct fs_inode_tail_d *tail = (struct fs_inode_tail_d *)(record + super.inode_size) - 1;
+            uint32_t csum = tail->csum;
+            tail->csum = 0;
+            int bad = (crc32c(0, record, super.inode_size) != csum);
+            tail->csum = csum;
+            if (bad) {
+                fprintf(stderr, "fs: inode %u fails its checksum, not cleaning\n", order[i]);
+                ret = ERROR_IO;
+                break;
+            }
+        }
+
+        int keep = victim_of(loaded);
+        for (int slot = 0; slot <= MAX_BLOCK_PER_INODE; slot++) {
+            uint32_t dno = *record_ptr(record, slot);
+            if (dno != (uint32_t)-1 && victim_of(dno & ~DNO_UNWRITTEN)) {
+                scan_add(scan, dno & ~DNO_UNWRITTEN, NULL, *n, slot);
+                keep = 1;
+            }
+        }
+        if (keep) {
+            *inos = (uint32_t *)realloc(*inos, (*n + 1) * sizeof(uint32_t));
+            *records = (uint8_t *)realloc(*records, (size_t)(*n + 1) * super.inode_size);
+            (*inos)[*n] = order[i];
+            memcpy(*records + (size_t)*n * super.inode_size, record, super.inode_size);
+            (*n)++;
+        }
+    }
+    free(blk);
+    free(order);
+    return ret;
+}
+
+/**
+ * @brief Pick up to FS_LOG_CLEAN_BATCH victims, the segments with the fewest
+ *        live blocks, as long as the free space elsewhere holds their copies
+ */
+static void pick_victims() {
+    uint32_t used[FS_LOG_CLEAN_BATCH];
+    uint32_t head = seg_of(super.log_head < super.params.max_dno ? super.log_head : 0);
+    lfs.nvictims = 0;
+    for (uint32_t s = 0; s < seg_count(); s++) {
+        uint32_t start = seg_start(s), end = seg_end(s);
+        uint32_t nfree = bitmap_count_zero(super.dmap, start, end);
+        if (s == head || nfree == 0 || nfree == end - start) {
+            continue;
+        }
+        uint32_t u = end - start - nfree;
+        if (lfs.nvictims == FS_LOG_CLEAN_BATCH && u >= used[FS_LOG_CLEAN_BATCH - 1]) {
+            continue;
+        }
+        int i = lfs.nvictims < FS_LOG_CLEAN_BATCH ? lfs.nvictims++ : FS_LOG_CLEAN_BATCH - 1;
+        for (; i > 0 && used[i - 1] > u; i--) {
+            used[i] = used[i - 1];
+            lfs.victims[i] = lfs.victims[i - 1];
+        }
+        used[i] = u;
+        lfs.victims[i] = s;
+    }
+
+    // * Copies must fit in the free blocks outside the victims, with a
+    // * segment to spare for the records logged again
+    uint32_t copies = super.log_segment, victim_free = 0;
+    int n = 0;
+    for (; n < lfs.nvictims; n++) {
+        uint32_t len = seg_end(lfs.victims[n]) - seg_start(lfs.victims[n]);
+        if (super.dmap->free < victim_free + (len - used[n]) + copies + used[n] + super.reserved) {
+            break;
+        }
+        copies += used[n];
+        victim_free += len - used[n];
+    }
+    lfs.nvictims = n;
+}
+
+/**
+ * @brief Drop the victims holding a block nobody points to, such as the map
+ *        or the copies of a snapshot, and the moves out of them
+ */
+static void drop_pinned(struct log_scan *scan) {
+    for (int v = 0; v < lfs.nvictims; v++) {
+        uint32_t start = seg_start(lfs.victims[v]), end = seg_end(lfs.victims[v]);
+        int pinned = 0;
+        for (uint32_t dno = start; dno < end && !pinned; dno++) {
+            if (!bitmap_test(super.dmap, dno) || lfs.live[dno] != 0) {
+                continue;
+            }
+            pinned = 1;
+            for (int m = 0; m < scan->nmoves; m++) {
+                if (scan->moves[m].dno == dno) {
+                    pinned = 0;
+                    break;
+                }
+            }
+        }
+        if (!pinned) {
+            continue;
+        }
+        int kept = 0;
+        for (int m = 0; m < scan->nmoves; m++) {
+            if (seg_of(scan->moves[m].dno) != lfs.victims[v]) {
+                scan->moves[kept++] = scan->moves[m];
+            }
+        }
+        scan->nmoves = kept;
+        lfs.victims[v--] = lfs.victims[--lfs.nvictims];
+    }
+}
+
+static int move_cmp(const void *a, const void *b) {
+    uint32_t x = ((const struct log_move *)a)->dno, y = ((const struct log_move *)b)->dno;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Copy the live blocks of the victims to the head of the log
+ * @return ERROR_NOSPACE if the copies did not fit, none of them is kept then
+ */
+static int move_blocks(struct log_scan *scan) {
+    uint32_t size_block = super.params.size_block;
+    uint8_t *seg = (uint8_t *)malloc((size_t)super.log_segment * size_block);
+    uint8_t *out = (uint8_t *)malloc((size_t)super.log_segment * size_block);
+    int ret = ERROR_NONE;
+
+    qsort(scan->moves, scan->nmoves, sizeof(struct log_move), move_cmp);
+    for (int m = 0; m < scan->nmoves && ret == ERROR_NONE; ) {
+        // * Every victim is read in one I/O, its live blocks go out in runs
+        uint32_t s = seg_of(scan->moves[m].dno);
+        uint32_t start = seg_start(s);
+        disk_read(DATA_OFF(start), seg, (seg_end(s) - start) * size_block);
+        int end = m;
+        while (end < scan->nmoves && seg_of(scan->moves[end].dno) == s) {
+            end++;
+        }
+        while (m < end) {
+            uint32_t len;
+            int dno = dno_alloc_meta(super.log_head, end - m, &len);
+            if (dno < 0) {
+                ret = ERROR_NOSPACE;
+                break;
+            }
+            for (uint32_t i = 0; i < len; i++, m++) {
+                memcpy(out + (size_t)i * size_block, seg + (size_t)(scan->moves[m].dno - start) * size_block, size_block);
+                scan->moves[m].to = dno + i;
+            }
+            disk_write(DATA_OFF(dno), out, len * size_block);
+        }
+        if (ret != ERROR_NONE) {
+            for (int i = 0; i < m; i++) {
+                dno_free(scan->moves[i].to, 1); // * Never committed, reusable at once
+            }
+        }
+    }
+    free(seg);
+    free(out);
+    return ret;
+}
+
+/**
+ * @brief Reclaim the segments with the fewest live blocks
+ * @attention Owners of the live blocks are found by scanning every inode:
+ *            resident ones get their pointers patched in memory and are
+ *            written back, the others have their records patched and logged
+ *            again. Everything is committed by one final disk_sync, so a
+ *            crash before it keeps the victims as they were. A block whose
+ *            record found no room in the log is left in its victim.
+ *            Caller holds fs_rwlock exclusively
+ */
+int log_clean() {
+    disk_sync();
+    dno_drain();
+    pick_victims();
+    if (lfs.nvictims == 0) {
+        return ERROR_NONE;
+    }
+
+    struct log_scan scan;
+    memset(&scan, 0, sizeof(scan));
+    scan.resident = (uint64_t *)calloc(super.params.max_ino / 64 + 1, sizeof(uint64_t));
+    cache_walk(scan_resident, &scan);
+
+    uint32_t *inos = NULL;
+    uint8_t *records = NULL;
+    int nrecords = 0;
+    int ret = scan_records(&scan, &inos, &records, &nrecords);
+    if (ret == ERROR_NONE) {
+        drop_pinned(&scan);
+        ret = move_blocks(&scan);
+    }
+    if (ret == ERROR_NONE && lfs.nvictims > 0) {
+        for (int m = 0; m < scan.nmoves; m++) {
+            struct log_move *move = &scan.moves[m];
+            if (move->inode == NULL) {
+                uint32_t *ptr = record_ptr(records + (size_t)move->rec * super.inode_size, move->slot);
+                *ptr = (*ptr & DNO_UNWRITTEN) | move->to;
+            } else if (move->slot == MAX_BLOCK_PER_INODE) {
+                move->inode->dno_dir = move->to;
+                cache_mark_dirty(move->inode);
+            } else {
+                move->inode->dno_reg[move->slot] = move->to;
+                cache_mark_dirty(move->inode);
+            }
+        }
+        for (int i = 0; i < nrecords && super.csum_off != 0; i++) {
+            uint8_t *record = records + (size_t)i * super.inode_size;
+            struct fs_inode_tail_d *tail = (struct fs_inode_tail_d *)(record + super.inode_size) - 1;
+            tail->csum = 0;
+            tail->csum = crc32c(0, record, super.inode_size);
+        }
+        int logged = log_write_inodes(inos, records, nrecords);
+        for (int m = 0; m < scan.nmoves; m++) {
+            struct log_move *move = &scan.moves[m];
+            if (move->inode == NULL && move->rec >= logged) {
+                dno_free(move->to, 1); // * Its record still points to the victim, which stays
+            } else {
+                dno_free(move->dno, 1);
+            }
+        }
+        if (logged < nrecords) {
+            ret = ERROR_NOSPACE;
+        } else {
+            lfs.cleaned += lfs.nvictims;
+        }
+        lfs.relogged += logged;
+        lfs.moved += scan.nmoves;
+        disk_sync();
+    }
+    lfs.nvictims = 0;
+    free(inos);
+    free(records);
+    free(scan.moves);
+    free(scan.resident);
+    return ret;
+}
+
+/**
+ * @brief Print the log counters
+ */
+void log_stats() {
+    fprintf(stderr, "log     : appended %llu, filled %llu, cleaned %llu segments, moved %llu, relogged %llu\n",
+            (unsigned long long)lfs.appended, (unsigned long long)lfs.filled,
+            (unsigned long long)lfs.cleaned, (unsigned long long)lfs.moved,
+            (unsigned long long)lfs.relogged);
+}
@@ -0,0 +1,185 @@
+#include "../include/fs.h"
+
+#define SLAB_SIZE       (64 * 1024) /* bytes carved per slab */
+#define SLAB_MAG_SIZE   32          /* objects cached per thread per pool */
+#define SLAB_MAX_POOLS  8
+
+/**
+ * Per-thread magazine, a small stack of free objects that can be handed out
+ * without taking the pool lock. gen invalidates magazines on slab_destroy.
+ */
+struct slab_magazine {
+    uint32_t gen;
+    int cnt;
+    void *objs[SLAB_MAG_SIZE];
+};
+
+static __thread struct slab_magazine slab_mags[SLAB_MAX_POOLS];
+static __thread int slab_mags_keyed = 0;
+static struct slab_pool *slab_pools[SLAB_MAX_POOLS]; // pool of each magazine slot
+static int slab_npools = 0;
+
+static pthread_key_t slab_key;
+static pthread_once_t slab_key_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Give the magazines of an exiting thread back to their pools
+ * @attention Magazines older than slab_destroy point into freed slabs and
+ *            are dropped
+ */
+static void slab_drain(void *arg) {
+    struct slab_magazine *mags = (struct slab_magazine *)arg;
+    for (int i = 0; i < SLAB_MAX_POOLS; i++) {
+        struct slab_pool *pool = __atomic_load_n(&slab_pools[i], __ATOMIC_ACQUIRE);
+        if (pool == NULL || mags[i].cnt == 0) {
+            continue;
+        }
+        pthread_mutex_lock(&pool->lock);
+        while (mags[i].gen == pool->gen && mags[i].cnt > 0) {
+            void *ptr = mags[i].objs[--mags[i].cnt];
+            *(void **)ptr = pool->free_list;
+            pool->free_list = ptr;
+        }
+        pthread_mutex_unlock(&pool->lock);
+        mags[i].cnt = 0;
+    }
+}
+
+static void slab_key_create() {
+    pthread_key_create(&slab_key, slab_drain);
+}
+
+/**
+ * @brief Carve a new slab into the free list
+ * @attention Caller should hold pool->lock
+ */
+static int slab_grow(struct slab_pool *pool) {
+    uint8_t *slab = (uint8_t *)malloc(SLAB_SIZE);
+    if (slab == NULL) {
+        return ERROR_NOSPACE;
+    }
+    // * The first word chains slabs together for slab_destroy
+    *(void **)slab = pool->slabs;
+    pool->slabs = slab;
+    pool->nslabs++;
+
+    for (uint8_t *obj = slab + pool->obj_size; obj + pool->obj_size <= slab + SLAB_SIZE;
+         obj += pool->obj_size) {
+        *(void **)obj = pool->free_list;
+        pool->free_list = obj;
+    }
+    return ERROR_NONE;
+}
+
+/**
+ * @brief Magazine of pool for the calling thread, NULL once SLAB_MAX_POOLS
+ *        pools are in use
+ * @attention Two threads may race to number a fresh pool, the loser's id is
+ *            simply wasted. The first call in a thread arms slab_drain for
+ *            its exit
+ */
+static struct slab_magazine *slab_mag(struct slab_pool *pool) {
+    int id = __atomic_load_n(&pool->id, __ATOMIC_ACQUIRE);
+    if (id == 0) {
+        int fresh = __atomic_add_fetch(&slab_npools, 1, __ATOMIC_RELAXED);
+        if (fresh > SLAB_MAX_POOLS) {
+            return NULL;
+        }
+        // * A slot lost to the race is never used, so naming it here is harmless
+        __atomic_store_n(&slab_pools[fresh - 1], pool, __ATOMIC_RELEASE);
+        if (__atomic_compare_exchange_n(&pool->id, &id, fresh, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            id = fresh;
+        }
+    }
+    if (!slab_mags_keyed) {
+        // * Any non-NULL value makes slab_drain run when the thread exits
+        pthread_once(&slab_key_once, slab_key_create);
+        pthread_setspecific(slab_key, slab_mags);
+        slab_mags_keyed = 1;
+    }
+    struct slab_magazine *mag = &slab_mags[id - 1];
+    if (mag->gen != pool->gen) {
+        mag->gen = pool->gen;
+        mag->cnt = 0;
+    }
+    return mag;
+}
+
+/**
+ * @brief Allocate one object from pool, not zeroed
+ */
+void *slab_alloc(struct slab_pool *pool) {
+    struct slab_magazine *mag = slab_mag(pool);
+    if (mag == NULL) {
+        return NULL;
+    }
+
+    if (mag->cnt == 0) {
+        // Refill half a magazine from the shared free list
+        pthread_mutex_lock(&pool->lock);
+        while (mag->cnt < SLAB_MAG_SIZE / 2) {
+            if (pool->free_list == NULL && slab_grow(pool) != ERROR_NONE) {
+                break;
+            }
+            mag->objs[mag->cnt++] = pool->free_list;
+            pool->free_list = *(void **)pool->free_list;
+        }
+        pthread_mutex_unlock(&pool->lock);
+        if (mag->cnt == 0) {
+            return NULL;
+        }
+    }
+
+    uint32_t live = __atomic_add_fetch(&pool->live, 1, __ATOMIC_RELAXED);
+    uint32_t peak = __atomic_load_n(&pool->peak, __ATOMIC_RELAXED);
+    while (live > peak &&
+           !__atomic_compare_exchange_n(&pool->peak, &peak, live, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+    return mag->objs[--mag->cnt];
+}
+
+/**
+ * @brief Return one object to pool
+ * @attention obj came from slab_alloc, so pool already owns a magazine slot
+ */
+void slab_free(struct slab_pool *pool, void *obj) {
+    struct slab_magazine *mag = slab_mag(pool);
+
+    if (mag->cnt == SLAB_MAG_SIZE) {
+        // Flush half a magazine back to the shared free list
+        pthread_mutex_lock(&pool->lock);
+        while (mag->cnt > SLAB_MAG_SIZE / 2) {
+            void *ptr = mag->objs[--mag->cnt];
+            *(void **)ptr = pool->free_list;
+            pool->free_list = ptr;
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+    mag->objs[mag->cnt++] = obj;
+    __atomic_sub_fetch(&pool->live, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Release every slab of pool at once, all objects become invalid
+ */
+void slab_destroy(struct slab_pool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->slabs != NULL) {
+        void *next = *(void **)pool->slabs;
+        free(pool->slabs);
+        pool->slabs = next;
+    }
+    pool->free_list = NULL;
+    pool->nslabs = 0;
+    pool->live = 0;
+    pool->gen++;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * @brief Print live and peak object counts of pool
+ */
+void slab_stats(struct slab_pool *pool) {
+    fprintf(stderr, "slab %-8s: obj %4zu B, live %u, peak %u, slabs %u\n",
+            pool->name, pool->obj_size, pool->live, pool->peak, pool->nslabs);
+}
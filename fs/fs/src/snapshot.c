@@ -0,0 +1,487 @@
+#include "../include/fs.h"
+
+extern struct fs_super super;
+extern struct custom_options fs_options;
+
+#define SNAP_NONE ((uint32_t)-1)
+
+/**
+ * A snapshot is the image as it was on disk when it was taken. Until a block
+ * is overwritten or freed, the snapshot and the live file system share it;
+ * right before it is overwritten, the block is copied and the copy is
+ * recorded in a two-level map indexed by block number. A freed data block is
+ * not copied but handed over: it stays allocated and its map entry points to
+ * itself. The map directory (super.snap_dir) holds the dno of one leaf per
+ * per_block blocks, a leaf holds the dno of the copy of each of its blocks,
+ * SNAP_NONE where the block is still shared. Leaves and copies are allocated
+ * from the live data bitmap.
+ */
+static struct {
+    uint32_t per_block; // map entries per block
+    uint32_t nleaves;
+    uint32_t *dir;      // dno of every leaf
+    uint32_t **leaves;  // leaves read so far
+    uint8_t **dmap;     // blocks of the data bitmap as of the snapshot, read on demand
+    int busy;           // copying, writes of the snapshot's own blocks need no copy
+    uint32_t *taken;    // dno of data blocks handed over since the last commit
+    uint32_t ntaken;
+    uint32_t taken_cap;
+    uint64_t copied;
+    uint64_t kept;
+} snap;
+
+/* Reads of a mounted snapshot run under the shared fs lock and fill the leaf cache */
+static pthread_mutex_t snap_read_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Guards snap.taken, frees under the shared fs lock add to it beside fsync */
+static pthread_mutex_t snap_taken_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Read a block where the live file system has it
+ */
+static void snap_read_live(uint32_t blocknr, void *buf) {
+    disk_read_live((off_t)blocknr * super.params.size_block, buf, super.params.size_block);
+}
+
+/**
+ * @brief Leaf of the map covering blocks [idx * per_block, (idx + 1) * per_block)
+ * @param fresh read it again, the live mount may have changed it
+ * @return NULL if no block it covers has been copied
+ */
+static uint32_t *snap_leaf(uint32_t idx, int fresh) {
+    if (fresh) {
+        disk_read_live(DATA_OFF(super.snap_dir + idx / snap.per_block) + (idx % snap.per_block) * sizeof(uint32_t),
+                       &snap.dir[idx], sizeof(uint32_t));
+    }
+    if (snap.dir[idx] == SNAP_NONE) {
+        return NULL;
+    }
+    if (snap.leaves[idx] == NULL || fresh) {
+        if (snap.leaves[idx] == NULL) {
+            snap.leaves[idx] = (uint32_t *)malloc(super.params.size_block);
+        }
+        disk_read_live(DATA_OFF(snap.dir[idx]), snap.leaves[idx], super.params.size_block);
+    }
+    return snap.leaves[idx];
+}
+
+/**
+ * @brief dno of the snapshot's copy of blocknr, SNAP_NONE if it is still shared
+ */
+static uint32_t snap_lookup(uint32_t blocknr, int fresh) {
+    uint32_t *leaf = snap_leaf(blocknr / snap.per_block, fresh);
+    return leaf ? leaf[blocknr % snap.per_block] : SNAP_NONE;
+}
+
+/**
+ * @brief Read blocknr as the snapshot sees it
+ * @attention The live mount writes a copy and its map entry before it
+ *            overwrites the block, so when the entry is still missing after
+ *            the read, the read returned the shared content
+ */
+static void snap_read_block(uint32_t blocknr, void *buf) {
+    uint32_t dno = snap_lookup(blocknr, 0);
+    if (dno == SNAP_NONE) {
+        snap_read_live(blocknr, buf);
+        if (!fs_options.snapshot) {
+            return; // * We are the only writer of the map
+        }
+        dno = snap_lookup(blocknr, 1);
+        if (dno == SNAP_NONE) {
+            return;
+        }
+    }
+    disk_read_live(DATA_OFF(dno), buf, super.params.size_block);
+}
+
+/**
+ * @brief Whether data block dno was in use when the snapshot was taken
+ */
+static int snap_dmap_test(uint32_t dno) {
+    uint32_t bits_per_block = super.params.size_block * 8;
+    uint32_t g = DNO_GROUP(dno), bit = dno % super.dpg;
+    uint32_t idx = g * super.dmap_blks + bit / bits_per_block;
+    if (snap.dmap[idx] == NULL) {
+        snap.dmap[idx] = (uint8_t *)malloc(super.params.size_block);
+        snap_read_block((super.dmap_off + g * super.group_size) / super.params.size_block + bit / bits_per_block,
+                        snap.dmap[idx]);
+    }
+    bit %= bits_per_block;
+    return (snap.dmap[idx][bit / 8] >> (bit % 8)) & 1;
+}
+
+/**
+ * @brief Whether the snapshot still needs the on-disk content of blocknr
+ * @attention Bitmaps and inode tables always belong to it, data blocks when
+ *            they were in use. The super block and the journal do not.
+ */
+static int snap_shared(uint32_t blocknr) {
+    uint32_t size_block = super.params.size_block;
+    uint32_t first = super.imap_off / size_block;
+    uint32_t group_blocks = super.group_size / size_block;
+    if (blocknr < first || (blocknr - first) / group_blocks >= super.groups) {
+        return 0;
+    }
+    uint32_t g = (blocknr - first) / group_blocks;
+    uint32_t local = (blocknr - first) % group_blocks;
+    uint32_t meta = (super.data_off - super.imap_off) / size_block;
+    if (local < meta) {
+        return 1;
+    }
+    if (local - meta >= super.dpg) {
+        return 0;
+    }
+    return snap_dmap_test(g * super.dpg + local - meta);
+}
+
+/**
+ * @brief Set up the in-memory map of the snapshot named in the super block
+ */
+void snap_load() {
+    uint32_t size_block = super.params.size_block;
+    uint32_t total = super.disk_blks;
+    snap.per_block = size_block / sizeof(uint32_t);
+    snap.nleaves = (total + snap.per_block - 1) / snap.per_block;
+    snap.dir = (uint32_t *)malloc((size_t)super.snap_blks * size_block);
+    for (uint32_t i = 0; i < super.snap_blks; i++) {
+        disk_read_live(DATA_OFF(super.snap_dir + i), (uint8_t *)snap.dir + (size_t)i * size_block, size_block);
+    }
+    snap.leaves = (uint32_t **)calloc(snap.nleaves, sizeof(uint32_t *));
+    snap.dmap = (uint8_t **)calloc((size_t)super.groups * super.dmap_blks, sizeof(uint8_t *));
+    snap.busy = 0;
+}
+
+/**
+ * @brief Drop the in-memory map
+ */
+void snap_unload() {
+    if (snap.dir == NULL) {
+        return;
+    }
+    for (uint32_t i = 0; i < snap.nleaves; i++) {
+        free(snap.leaves[i]);
+    }
+    for (uint32_t i = 0; i < super.groups * super.dmap_blks; i++) {
+        free(snap.dmap[i]);
+    }
+    free(snap.leaves);
+    free(snap.dmap);
+    free(snap.dir);
+    free(snap.taken);
+    snap.dir = NULL;
+    snap.leaves = NULL;
+    snap.dmap = NULL;
+    snap.taken = NULL;
+    snap.ntaken = 0;
+    snap.taken_cap = 0;
+}
+
+/**
+ * @brief Claim the blocks of the map and the copies in the data bitmap
+ * @attention Copies reach the bitmap one commit after they are written, so
+ *            after a crash their bits may be missing. Runs on the recovery
+ *            path only, after a clean umount the bitmap has them all.
+ */
+int snap_recover() {
+    int ret = ERROR_NONE;
+    for (uint32_t i = 0; i < super.snap_blks && ret == ERROR_NONE; i++) {
+        ret = dno_claim(super.snap_dir + i);
+    }
+    for (uint32_t idx = 0; idx < snap.nleaves && ret == ERROR_NONE; idx++) {
+        uint32_t *leaf = snap_leaf(idx, 0);
+        if (leaf == NULL) {
+            continue;
+        }
+        ret = dno_claim(snap.dir[idx]);
+        for (uint32_t i = 0; i < snap.per_block && ret == ERROR_NONE; i++) {
+            if (leaf[i] != SNAP_NONE) {
+                ret = dno_claim(leaf[i]);
+            }
+        }
+    }
+    return ret;
+}
+
+/**
+ * @brief Take the blocks handed over since the last commit out of snap.taken
+ * @attention snap_free adds to it under alloc_lock, so it is emptied before
+ *            anything that allocates or frees
+ */
+static uint32_t *snap_take_list(uint32_t *n) {
+    pthread_mutex_lock(&snap_taken_lock);
+    uint32_t *taken = snap.taken;
+    *n = snap.ntaken;
+    snap.taken = NULL;
+    snap.ntaken = 0;
+    snap.taken_cap = 0;
+    pthread_mutex_unlock(&snap_taken_lock);
+    return taken;
+}
+
+/**
+ * @brief Free the map and every copy, the snapshot must be gone from the super block
+ */
+static int snap_release(uint32_t dir, uint32_t blks) {
+    int ret = maps_load();
+    uint32_t ntaken;
+    uint32_t *taken = snap_take_list(&ntaken);
+    for (uint32_t i = 0; i < ntaken && ret == ERROR_NONE; i++) {
+        dno_free(taken[i], 1); // * Never mapped, freed after all
+    }
+    free(taken);
+    for (uint32_t idx = 0; idx < snap.nleaves && ret == ERROR_NONE; idx++) {
+        uint32_t *leaf = snap_leaf(idx, 0);
+        if (leaf == NULL) {
+            continue;
+        }
+        for (uint32_t i = 0; i < snap.per_block; i++) {
+            if (leaf[i] != SNAP_NONE) {
+                dno_free(leaf[i], 1);
+            }
+        }
+        dno_free(snap.dir[idx], 1);
+    }
+    if (ret == ERROR_NONE) {
+        ret = dno_free(dir, blks);
+    }
+    snap_unload();
+    return ret;
+}
+
+/**
+ * @brief Give the snapshot up when there is no room left for copies
+ */
+static void snap_drop() {
+    uint32_t dir = super.snap_dir, blks = super.snap_blks;
+    fprintf(stderr, "snapshot: out of space after %llu copies, dropping snapshot of generation %u\n",
+            (unsigned long long)snap.copied, super.snap_generation);
+    super.snap_blks = 0;
+    super_write(FS_STATE_DIRTY);
+    snap_release(dir, blks);
+}
+
+/**
+ * @brief Allocate a block for the map or a copy
+ * @attention Blocks freed since the last commit are never returned by
+ *            dno_alloc: after a crash the file they were freed from owns
+ *            them again
+ */
+static int snap_alloc(uint32_t goal) {
+    uint32_t len;
+    return dno_alloc(goal, 1, 1, &len);
+}
+
+/**
+ * @brief Where to look for a block of the map or a copy of blocknr, the
+ *        start of its group
+ */
+static uint32_t snap_goal(uint32_t blocknr) {
+    uint32_t size_block = super.params.size_block;
+    uint32_t first = super.imap_off / size_block;
+    return blocknr > first ? (blocknr - first) / (super.group_size / size_block) * super.dpg : 0;
+}
+
+/**
+ * @brief Point the map entry of blocknr to dno, allocating its leaf if needed
+ * @attention The leaf and the directory entry go through the running
+ *            transaction when there is one
+ */
+static int snap_map(uint32_t blocknr, uint32_t dno) {
+    uint32_t size_block = super.params.size_block;
+    uint32_t idx = blocknr / snap.per_block;
+    int new_leaf = (snap_leaf(idx, 0) == NULL);
+    if (new_leaf) {
+        int leaf = snap_alloc(snap_goal(blocknr));
+        if (leaf < 0) {
+            return ERROR_NOSPACE;
+        }
+        snap.dir[idx] = leaf;
+        snap.leaves[idx] = (uint32_t *)malloc(size_block);
+        memset(snap.leaves[idx], 0xff, size_block);
+    }
+    snap.leaves[idx][blocknr % snap.per_block] = dno;
+    journal_write(DATA_OFF(snap.dir[idx]), snap.leaves[idx], size_block);
+    if (new_leaf) {
+        journal_write(DATA_OFF(super.snap_dir + idx / snap.per_block) + (idx % snap.per_block) * sizeof(uint32_t),
+                      &snap.dir[idx], sizeof(uint32_t));
+    }
+    return ERROR_NONE;
+}
+
+/**
+ * @brief Copy blocknr for the snapshot before it is overwritten
+ * @return 1 if a copy was made, its block is now allocated in the data bitmap
+ * @attention The copy and its map entry reach the disk before the caller
+ *            goes on, or join the transaction that overwrites blocknr, so
+ *            the snapshot never sees the new content
+ */
+int snap_cow(uint32_t blocknr) {
+    if (super.snap_blks == 0 || snap.busy || fs_options.snapshot) {
+        return 0;
+    }
+    if (snap_lookup(blocknr, 0) != SNAP_NONE || !snap_shared(blocknr)) {
+        return 0;
+    }
+    snap.busy = 1;
+    uint32_t size_block = super.params.size_block;
+    int dno = snap_alloc(snap_goal(blocknr));
+    if (dno < 0) {
+        snap.busy = 0;
+        snap_drop();
+        return 0;
+    }
+
+    uint8_t *buf = (uint8_t *)malloc(size_block);
+    snap_read_live(blocknr, buf);
+    disk_write(DATA_OFF(dno), buf, size_block);
+    free(buf);
+    if (snap_map(blocknr, dno) != ERROR_NONE) {
+        snap.busy = 0;
+        snap_drop();
+        dno_free(dno, 1);
+        return 0;
+    }
+    snap.copied++;
+    snap.busy = 0;
+    return 1;
+}
+
+/**
+ * @brief Hand data block dno over to the snapshot instead of freeing it
+ * @return 1 if the snapshot keeps it, the caller leaves it allocated
+ * @attention Nothing is copied or written now: the block stays as it is,
+ *            which is what the snapshot reads while it is shared, and its
+ *            map entry joins the transaction committing the free, see
+ *            snap_journal_taken
+ */
+int snap_free(uint32_t dno) {
+    if (super.snap_blks == 0 || fs_options.snapshot) {
+        return 0;
+    }
+    uint32_t blocknr = DATA_OFF(dno) / super.params.size_block;
+    if (snap_lookup(blocknr, 0) != SNAP_NONE || !snap_shared(blocknr)) {
+        return 0;
+    }
+    pthread_mutex_lock(&snap_taken_lock);
+    if (snap.ntaken == snap.taken_cap) {
+        snap.taken_cap = snap.taken_cap ? snap.taken_cap * 2 : 16;
+        snap.taken = (uint32_t *)realloc(snap.taken, snap.taken_cap * sizeof(uint32_t));
+    }
+    snap.taken[snap.ntaken++] = dno;
+    pthread_mutex_unlock(&snap_taken_lock);
+    return 1;
+}
+
+/**
+ * @brief Map every block handed over by snap_free since the last commit
+ *        to itself, through the running transaction
+ * @attention Called before the bitmaps are logged, new leaves dirty them.
+ *            Without room for a leaf the snapshot is dropped and the blocks
+ *            left are freed after all
+ */
+void snap_journal_taken() {
+    uint32_t ntaken;
+    uint32_t *taken = snap_take_list(&ntaken);
+    for (uint32_t i = 0; i < ntaken; i++) {
+        if (super.snap_blks == 0) {
+            dno_free(taken[i], 1);
+        } else if (snap_map(DATA_OFF(taken[i]) / super.params.size_block, taken[i]) == ERROR_NONE) {
+            snap.kept++;
+        } else {
+            snap_drop();
+            dno_free(taken[i], 1);
+        }
+    }
+    free(taken);
+}
+
+/**
+ * @brief Copy every shared block in [offset, offset + size) before it is written
+ */
+void snap_cow_range(off_t offset, int size) {
+    uint32_t size_block = super.params.size_block;
+    for (off_t blk = BLK_ROUND_DOWN(offset); blk < offset + size; blk += size_block) {
+        snap_cow(blk / size_block);
+    }
+}
+
+/**
+ * @brief Read through the snapshot, for read-only snapshot mounts
+ */
+int snap_read(off_t offset, void *out_content, int size) {
+    uint32_t size_block = super.params.size_block;
+    uint8_t *buf = (uint8_t *)malloc(size_block);
+    uint8_t *out = (uint8_t *)out_content;
+    off_t end = offset + size;
+    pthread_mutex_lock(&snap_read_lock);
+    for (off_t blk = BLK_ROUND_DOWN(offset); blk < end; blk += size_block) {
+        off_t from = offset > blk ? offset : blk;
+        off_t to = end < blk + size_block ? end : blk + size_block;
+        snap_read_block(blk / size_block, buf);
+        memcpy(out + (from - offset), buf + (from - blk), to - from);
+    }
+    pthread_mutex_unlock(&snap_read_lock);
+    free(buf);
+    return ERROR_NONE;
+}
+
+/**
+ * @brief Take a snapshot of the file system as it is now
+ * @attention Everything dirty is committed first. Taking the snapshot itself
+ *            writes an empty map directory and the super block, whatever the
+ *            size of the file system; blocks are copied later, one by one,
+ *            as they are first modified.
+ */
+int snap_create() {
+    if (super.snap_blks != 0) {
+        return ERROR_EXISTS;
+    }
+    if (super.group_size == 0) {
+        return ERROR_OPNOTSUPP; // * Images without block groups
+    }
+    disk_sync();
+
+    uint32_t size_block = super.params.size_block;
+    uint32_t per_block = size_block / sizeof(uint32_t);
+    uint32_t nleaves = (super.disk_blks + per_block - 1) / per_block;
+    uint32_t blks = (nleaves + per_block - 1) / per_block;
+    uint32_t len;
+    int dno = dno_alloc(0, blks, blks, &len);
+    if (dno < 0) {
+        return ERROR_NOSPACE;
+    }
+    uint8_t *buf = (uint8_t *)malloc(size_block);
+    memset(buf, 0xff, size_block);
+    for (uint32_t i = 0; i < blks; i++) {
+        disk_write(DATA_OFF(dno + i), buf, size_block);
+    }
+    free(buf);
+
+    super.snap_dir = dno;
+    super.snap_blks = blks;
+    super.snap_generation = super.generation;
+    snap_load();
+    snap.copied = 0;
+    snap.kept = 0;
+    super_write(FS_STATE_DIRTY); // * From here on shared blocks are copied before they change
+    disk_sync();
+    fprintf(stderr, "snapshot: took snapshot of generation %u\n", super.snap_generation);
+    return ERROR_NONE;
+}
+
+/**
+ * @brief Delete the snapshot and free its copies
+ */
+int snap_delete() {
+    if (super.snap_blks == 0) {
+        return ERROR_NOTFOUND;
+    }
+    uint32_t dir = super.snap_dir, blks = super.snap_blks;
+    super.snap_blks = 0;
+    super_write(FS_STATE_DIRTY); // * Gone before its blocks are, a crash only leaks them
+    fprintf(stderr, "snapshot: deleted snapshot of generation %u, %llu blocks copied, %llu kept\n",
+            super.snap_generation, (unsigned long long)snap.copied, (unsigned long long)snap.kept);
+    int ret = snap_release(dir, blks); // * Leaks the blocks if the bitmaps are unusable, fsck.fs reclaims them
+    disk_sync();
+    return ret;
+}
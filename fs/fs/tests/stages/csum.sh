@@ -0,0 +1,69 @@
+#!/bin/bash
+
+TEST_CASE="case 9 - metadata checksums"
+
+DEVICE="$HOME"/ddriver
+FSCK="$ROOT_PATH"/../build/fsck.fs
+
+# 超级块fs_super_d中imap.offset与inodes.offset的字节偏移, 见include/disk.h
+SUPER_IMAP_OFFSET=36
+SUPER_INODES_OFFSET=52
+
+function read_u32 () {
+    od -An -tu4 -j "$1" -N4 "$DEVICE" | tr -d ' '
+}
+
+# 取反介质上偏移$1处的一个字节, 再调用一次即恢复
+function flip_byte () {
+    _OFF=$1
+    _BYTE=$(od -An -tu1 -j "$_OFF" -N1 "$DEVICE" | tr -d ' ')
+    printf "$(printf '\\%03o' $((_BYTE ^ 0xff)))" | dd of="$DEVICE" bs=1 seek="$_OFF" conv=notrunc status=none
+}
+
+# 取反偏移$1处的字节后, fsck.fs必须报告校验和不符, 检查完恢复该字节
+function check_flip () {
+    _OFF=$1
+    _WHAT=$2
+    _TEST_CASE=$3
+    flip_byte "$_OFF"
+    OUTPUT=$("$FSCK" -n "$DEVICE" 2>&1)
+    RET=$?
+    flip_byte "$_OFF"
+    if (( RET == 0 )) || ! echo "$OUTPUT" | grep "checksum" > /dev/null; then
+        fail "$_TEST_CASE: 破坏$_WHAT的一个字节后, fsck.fs没有报告校验和不符"
+        return 1
+    fi
+    return 0
+}
+
+clean_mount
+clean_ddriver
+
+try_mount_or_fail
+mkdir_and_check "${MNTPOINT}"/dir0
+touch_and_check "${MNTPOINT}"/dir0/file0
+echo "checksum" > "${MNTPOINT}"/dir0/file0
+clean_mount
+
+sleep 1
+
+TEST_CASE="case 9.1 - clean image passes fsck.fs"
+if ! "$FSCK" -n "$DEVICE" > /dev/null 2>&1; then
+    fail "$TEST_CASE: 未破坏的介质没有通过fsck.fs检查"
+    clean_ddriver
+    exit 1
+fi
+pass "$TEST_CASE"
+
+TEST_CASE="case 9.2 - corrupt inode table block"
+# 根目录inode是0号group第一个inode表块中的第一条记录
+if check_flip $(($(read_u32 $SUPER_INODES_OFFSET) + 8)) "inode表块" "$TEST_CASE"; then
+    pass "$TEST_CASE"
+fi
+
+TEST_CASE="case 9.3 - corrupt inode bitmap block"
+if check_flip "$(read_u32 $SUPER_IMAP_OFFSET)" "inode位图块" "$TEST_CASE"; then
+    pass "$TEST_CASE"
+fi
+
+clean_ddriver
@@ -0,0 +1,103 @@
+#!/bin/bash
+
+TEST_CASE="case 8 - log-structured mode"
+
+LOG_FILES=32          # 被反复覆盖写的文件数
+LOG_BATCH=500         # 每次挂载期间的随机覆盖写次数
+LOG_MAX_BATCHES=20    # 清理器始终没有运行时放弃
+LOG_SHADOW=$(mktemp -d)
+LOG_STATS=$(mktemp)
+LOG_CHUNK=$(mktemp)
+LOG_PID=0
+
+# 前台运行并带--stats, 卸载时的统计输出到$LOG_STATS, 据此判断清理器是否运行过
+function mount_fuse_log () {
+    "$ROOT_PATH"/../build/"${PROJECT_NAME}" --device="$HOME"/ddriver --log --stats -f "${MNTPOINT}" 2>"$LOG_STATS" &
+    LOG_PID=$!
+    for _ in $(seq 50); do
+        if check_mount; then
+            return 0
+        fi
+        sleep 0.1
+    done
+    return 1
+}
+
+function umount_fuse_log () {
+    umount "${MNTPOINT}"
+    wait "$LOG_PID"
+}
+
+# 在文件$1的随机位置覆盖写1~2个扇区的随机数据, 同时写入影子副本, 每次写后fsync使其追加到日志
+function overwrite_random () {
+    _FILE=$1
+    _SECTORS=$((1 + RANDOM % 2))
+    _SEEK=$((RANDOM % (9 - _SECTORS)))
+    head -c $((_SECTORS * 512)) /dev/urandom > "$LOG_CHUNK"
+    dd if="$LOG_CHUNK" of="${MNTPOINT}/$_FILE" bs=512 seek="$_SEEK" conv=notrunc,fsync status=none || return 1
+    dd if="$LOG_CHUNK" of="$LOG_SHADOW/$_FILE" bs=512 seek="$_SEEK" conv=notrunc status=none
+}
+
+function check_contents () {
+    _TEST_CASE=$1
+    for i in $(seq 0 $((LOG_FILES - 1))); do
+        if ! cmp -s "${MNTPOINT}/log$i" "$LOG_SHADOW/log$i"; then
+            fail "$_TEST_CASE: 文件${MNTPOINT}/log$i的内容与写入的不一致"
+            return 1
+        fi
+    done
+    return 0
+}
+
+function log_cleanup () {
+    rm -rf "$LOG_SHADOW" "$LOG_STATS" "$LOG_CHUNK"
+}
+
+clean_mount
+clean_ddriver
+
+if ! mount_fuse_log; then
+    fail "$TEST_CASE: 以--log格式化并挂载失败"
+    log_cleanup
+    exit 1
+fi
+
+for i in $(seq 0 $((LOG_FILES - 1))); do
+    head -c 4096 /dev/urandom > "$LOG_SHADOW/log$i"
+    cp "$LOG_SHADOW/log$i" "${MNTPOINT}/log$i"
+done
+
+TEST_CASE="case 8.1 - random overwrites until the cleaner runs"
+CLEANED=0
+for _ in $(seq "$LOG_MAX_BATCHES"); do
+    for _ in $(seq "$LOG_BATCH"); do
+        if ! overwrite_random "log$((RANDOM % LOG_FILES))"; then
+            fail "$TEST_CASE: 覆盖写${MNTPOINT}下的文件失败"
+            break 2
+        fi
+    done
+    umount_fuse_log
+    CLEANED=$(grep -o "cleaned [0-9]*" "$LOG_STATS" | awk '{ print $2 }')
+    if (( ${CLEANED:-0} > 0 )); then
+        break
+    fi
+    if ! mount_fuse_log; then
+        fail "$TEST_CASE: 重新挂载失败"
+        break
+    fi
+done
+if (( ${CLEANED:-0} > 0 )); then
+    pass "$TEST_CASE"
+else
+    fail "$TEST_CASE: $((LOG_MAX_BATCHES * LOG_BATCH))次覆盖写后清理器仍未回收任何段"
+fi
+
+TEST_CASE="case 8.2 - contents after remount"
+clean_mount
+if mount_fuse_log && check_contents "$TEST_CASE"; then
+    pass "$TEST_CASE"
+fi
+
+umount_fuse_log
+log_cleanup
+clean_ddriver
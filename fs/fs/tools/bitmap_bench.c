@@ -0,0 +1,158 @@
+/**
+ * bitmap_bench - microbenchmark of the bitmap allocator
+ *
+ * Usage: bitmap_bench [bits] [ops]
+ *
+ * For each fullness level a bitmap of bits bits is filled at random to that
+ * level, then ops single-bit allocations are timed, each followed by freeing
+ * a random used bit so that the fullness stays put. The same is done for
+ * runs of 8 bits with bitmap_alloc_range, which settles for a shorter run
+ * a few groups after finding one, and for a byte-by-byte scan from bit 0,
+ * which is how allocation worked before the word scan, the summary levels
+ * and the next-fit cursor. Results are in nanoseconds per operation.
+ */
+#include "../include/fs.h"
+#include <time.h>
+
+#define BENCH_DEFAULT_BITS (1u << 18)
+#define BENCH_DEFAULT_OPS  10000
+#define BENCH_RUN          8
+
+static const int levels[] = { 1, 50, 99 }; // percent of bits in use
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ull;
+
+/**
+ * @brief xorshift64, a fixed seed keeps runs comparable
+ */
+static uint32_t rng(uint32_t bound) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (uint32_t)(rng_state % bound);
+}
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**
+ * @brief A bitmap of size bits with percent of them set at random
+ */
+static struct bitmap *bench_fill(uint32_t size, int percent) {
+    struct bitmap *bitmap = bitmap_init(size);
+    uint32_t target = (uint32_t)((uint64_t)size * percent / 100);
+    while (size - bitmap->free < target) {
+        uint32_t bit = rng(size);
+        if (!bitmap_test(bitmap, bit)) {
+            bitmap_set(bitmap, bit);
+        }
+    }
+    return bitmap;
+}
+
+/**
+ * @brief Free len used bits, each the first one of a random word that has
+ *        any, keeps fullness steady
+ */
+static void bench_release(struct bitmap *bitmap, uint32_t len) {
+    for (uint32_t i = 0; i < len; i++) {
+        uint32_t w = rng(bitmap->nwords);
+        while (bitmap->words[w] == 0 ||
+               w * 64 + (uint32_t)__builtin_ctzll(bitmap->words[w]) >= bitmap->size) {
+            w = (w + 1) % bitmap->nwords;
+        }
+        bitmap_clear(bitmap, w * 64 + __builtin_ctzll(bitmap->words[w]));
+    }
+}
+
+/**
+ * @brief First zero bit, scanning byte by byte from bit 0
+ */
+static int naive_alloc(struct bitmap *bitmap) {
+    const uint8_t *bytes = (const uint8_t *)bitmap->words;
+    for (uint32_t i = 0; i < bitmap->size / 8; i++) {
+        if (bytes[i] == 0xff) {
+            continue;
+        }
+        for (int j = 0; j < 8; j++) {
+            if (!(bytes[i] & (1u << j))) {
+                bitmap_set(bitmap, i * 8 + j);
+                return i * 8 + j;
+            }
+        }
+    }
+    return ERROR_NOSPACE;
+}
+
+static double bench_alloc(uint32_t size, int percent, uint32_t ops) {
+    struct bitmap *bitmap = bench_fill(size, percent);
+    double ns = 0;
+    for (uint32_t i = 0; i < ops; i++) {
+        double start = now_ns();
+        int bit = bitmap_alloc(bitmap);
+        ns += now_ns() - start;
+        if (bit < 0) {
+            break;
+        }
+        bench_release(bitmap, 1);
+    }
+    bitmap_free(bitmap);
+    return ns / ops;
+}
+
+static double bench_alloc_range(uint32_t size, int percent, uint32_t ops) {
+    struct bitmap *bitmap = bench_fill(size, percent);
+    uint32_t goal = 0;
+    double ns = 0;
+    for (uint32_t i = 0; i < ops; i++) {
+        uint32_t len;
+        double start = now_ns();
+        int bit = bitmap_alloc_range(bitmap, goal, BENCH_RUN, 1, &len);
+        ns += now_ns() - start;
+        if (bit < 0) {
+            break;
+        }
+        goal = bit + len;
+        bench_release(bitmap, len);
+    }
+    bitmap_free(bitmap);
+    return ns / ops;
+}
+
+static double bench_naive(uint32_t size, int percent, uint32_t ops) {
+    struct bitmap *bitmap = bench_fill(size, percent);
+    double ns = 0;
+    for (uint32_t i = 0; i < ops; i++) {
+        double start = now_ns();
+        int bit = naive_alloc(bitmap);
+        ns += now_ns() - start;
+        if (bit < 0) {
+            break;
+        }
+        bench_release(bitmap, 1);
+    }
+    bitmap_free(bitmap);
+    return ns / ops;
+}
+
+int main(int argc, char **argv) {
+    uint32_t size = argc > 1 ? (uint32_t)strtoul(argv[1], NULL, 0) : BENCH_DEFAULT_BITS;
+    uint32_t ops = argc > 2 ? (uint32_t)strtoul(argv[2], NULL, 0) : BENCH_DEFAULT_OPS;
+    if (size < 64 || ops == 0) {
+        fprintf(stderr, "usage: %s [bits >= 64] [ops > 0]\n", argv[0]);
+        return 1;
+    }
+
+    printf("bitmap of %u bits, %u ops, ns/op\n", size, ops);
+    printf("%6s %12s %12s %12s\n", "full", "alloc", "alloc_range", "byte scan");
+    for (size_t i = 0; i < sizeof(levels) / sizeof(levels[0]); i++) {
+        double alloc = bench_alloc(size, levels[i], ops);
+        double range = bench_alloc_range(size, levels[i], ops);
+        double naive = bench_naive(size, levels[i], ops);
+        printf("%5d%% %12.1f %12.1f %12.1f\n", levels[i], alloc, range, naive);
+    }
+    return 0;
+}
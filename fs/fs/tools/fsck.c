@@ -0,0 +1,853 @@
+/**
+ * fsck.fs - offline consistency checker for fs images
+ *
+ * Usage: fsck.fs [-n | -y] [-j threads] image
+ *
+ * The image is memory-mapped, a pending journal transaction is replayed, and
+ * the directory tree is walked from the root by a pool of threads, one
+ * directory at a time. Every inode and data block reached is recorded in
+ * reference bitmaps, which are then compared against the on-disk inode and
+ * data bitmaps to find leaks, blocks in use but marked free, and blocks
+ * claimed by more than one inode. Blocks of a snapshot, its map and the
+ * copies it points to, count as referenced. On FS_VERSION 3 images the
+ * CRC32C of the super block, of every inode record and directory block
+ * reached, and of the bitmap blocks is verified too, and a repair stamps
+ * them all again. On log-structured images records are found through the
+ * inode location table of each group, and the blocks holding them count as
+ * referenced.
+ *
+ * Without -y the image is mapped privately, so repairs are carried out in
+ * memory only and nothing reaches the image. Exit codes follow e2fsck: 0 clean,
+ * 1 errors corrected, 4 errors left uncorrected, 8 operational error.
+ */
+#include "../include/fs.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdarg.h>
+
+#define FSCK_OK          0
+#define FSCK_CORRECTED   1
+#define FSCK_UNCORRECTED 4
+#define FSCK_ERROR       8
+
+#define DNO_NONE ((uint32_t)-1)
+
+/* Geometry of the image, as disk_mount derives it */
+static struct {
+    uint8_t *base;
+    size_t size;
+    int repair;
+    struct fs_super_d *super_d;
+
+    uint32_t version;
+    uint32_t size_block;
+    uint32_t groups;
+    uint32_t ipg;
+    uint32_t dpg;
+    uint32_t max_ino;
+    uint32_t max_dno;
+    uint32_t inode_size;
+    uint32_t inline_max;
+    off_t group_size;
+    off_t imap_off;
+    off_t dmap_off;
+    off_t inodes_off;
+    off_t data_off;
+    off_t csum_off;    // checksum block of group 0, 0 before FS_VERSION 3
+    uint32_t log_segment; // 0 unless the image is log-structured
+    uint32_t rec_per_block;
+
+    uint64_t *ino_ref; // inodes reached by the walk
+    uint64_t *dno_ref; // data blocks referenced by reached inodes
+} img;
+
+static struct {
+    uint64_t dirs;
+    uint64_t files;
+    uint64_t blocks;
+    uint64_t errors;
+    uint64_t fixed;
+} stats;
+
+/* Directories waiting to be checked, shared by the worker threads */
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint32_t *items;
+    uint32_t n;
+    uint32_t cap;
+    int busy; // workers checking a directory, which may queue more
+} queue = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+/* A data block reference that lost the race for its block */
+struct dup_ref {
+    uint32_t ino;
+    int slot; // index into dno_reg, or -1 for dno_dir
+};
+
+static struct {
+    pthread_mutex_t lock;
+    struct dup_ref *items;
+    uint32_t n;
+    uint32_t cap;
+} dups = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Print one problem, and count it as fixed when repairing
+ */
+static void problem(const char *fmt, ...) {
+    va_list ap;
+    pthread_mutex_lock(&report_lock);
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+    printf(img.repair ? " (fixed)\n" : "\n");
+    pthread_mutex_unlock(&report_lock);
+    __atomic_fetch_add(&stats.errors, 1, __ATOMIC_RELAXED);
+    if (img.repair) {
+        __atomic_fetch_add(&stats.fixed, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * @brief Set bit index of an atomic bitset
+ * @return 1 if it was already set
+ */
+static int ref_set(uint64_t *bits, uint32_t index) {
+    uint64_t bit = (uint64_t)1 << (index % 64);
+    return (__atomic_fetch_or(&bits[index / 64], bit, __ATOMIC_RELAXED) & bit) != 0;
+}
+
+static int ref_test(const uint64_t *bits, uint32_t index) {
+    return (bits[index / 64] >> (index % 64)) & 1;
+}
+
+static uint8_t *block_at(uint32_t dno) {
+    off_t off = img.data_off + (off_t)(dno / img.dpg) * img.group_size + (off_t)(dno % img.dpg) * img.size_block;
+    return img.base + off;
+}
+
+/**
+ * @brief Entry of ino in the inode location table of a log-structured image
+ */
+static uint32_t *itab_at(uint32_t ino) {
+    off_t off = img.inodes_off + (off_t)(ino / img.ipg) * img.group_size + (off_t)(ino % img.ipg) * sizeof(uint32_t);
+    return (uint32_t *)(img.base + off);
+}
+
+/**
+ * @brief Record of ino, NULL if a log-structured image has none for it
+ */
+static struct fs_inode_d *inode_at(uint32_t ino) {
+    if (img.log_segment != 0) {
+        uint32_t entry = *itab_at(ino);
+        if (entry == DNO_NONE || entry / img.rec_per_block >= img.max_dno) {
+            return NULL;
+        }
+        return (struct fs_inode_d *)(block_at(entry / img.rec_per_block) + (entry % img.rec_per_block) * img.inode_size);
+    }
+    off_t off = img.inodes_off + (off_t)(ino / img.ipg) * img.group_size + (off_t)(ino % img.ipg) * img.inode_size;
+    return (struct fs_inode_d *)(img.base + off);
+}
+
+/**
+ * @brief Byte and bit of index in an on-disk bitmap made of per-group slices
+ */
+static uint8_t *map_byte(off_t map_off, uint32_t per_group, uint32_t index, uint8_t *bit) {
+    uint32_t local = img.groups == 1 ? index : index % per_group;
+    *bit = 1u << (local % 8);
+    return img.base + map_off + (off_t)(index / per_group) * img.group_size + local / 8;
+}
+
+/**
+ * @brief Whether inode records carry flags and inline data, FS_VERSION 2 on
+ */
+static int has_flags() {
+    return img.inode_size > offsetof(struct fs_inode_d, flags);
+}
+
+static struct fs_inode_tail_d *inode_tail(struct fs_inode_d *inode_d) {
+    return (struct fs_inode_tail_d *)((uint8_t *)inode_d + img.inode_size) - 1;
+}
+
+/**
+ * @brief CRC32C of an inode record, computed with its csum set to 0
+ */
+static uint32_t record_csum(struct fs_inode_d *inode_d) {
+    struct fs_inode_tail_d *tail = inode_tail(inode_d);
+    uint32_t stored = tail->csum;
+    tail->csum = 0;
+    uint32_t csum = crc32c(0, inode_d, img.inode_size);
+    tail->csum = stored; // * The image may be mapped shared, put it back
+    return csum;
+}
+
+/**
+ * @brief Record the data block referenced by slot of inode ino
+ * @return 0 if the reference is unusable and was dropped
+ */
+static int check_block(uint32_t ino, int slot, uint32_t *dno) {
+    uint32_t blk = *dno;
+    if (blk == DNO_NONE) {
+        return 1;
+    }
+    blk &= ~DNO_UNWRITTEN;
+    if (blk >= img.max_dno) {
+        problem("inode %u: block %u out of range", ino, blk);
+        if (img.repair) {
+            *dno = DNO_NONE;
+        }
+        return 0;
+    }
+    __atomic_fetch_add(&stats.blocks, 1, __ATOMIC_RELAXED);
+    if (ref_set(img.dno_ref, blk)) {
+        pthread_mutex_lock(&dups.lock);
+        if (dups.n == dups.cap) {
+            dups.cap = dups.cap ? dups.cap * 2 : 64;
+            dups.items = (struct dup_ref *)realloc(dups.items, dups.cap * sizeof(struct dup_ref));
+        }
+        dups.items[dups.n].ino = ino;
+        dups.items[dups.n].slot = slot;
+        dups.n++;
+        pthread_mutex_unlock(&dups.lock);
+    }
+    return 1;
+}
+
+/**
+ * @brief Check the record of a regular file reached for the first time
+ */
+static void check_file(uint32_t ino, struct fs_inode_d *inode_d) {
+    int max_size = MAX_BLOCK_PER_INODE * img.size_block;
+    int is_inline = has_flags() && (inode_d->flags & INODE_INLINE);
+
+    __atomic_fetch_add(&stats.files, 1, __ATOMIC_RELAXED);
+    if (is_inline) {
+        max_size = img.inline_max;
+    }
+    if (inode_d->size < 0 || inode_d->size > max_size) {
+        problem("inode %u: size %d out of range", ino, inode_d->size);
+        if (img.repair) {
+            inode_d->size = inode_d->size < 0 ? 0 : max_size;
+        }
+    }
+    for (int i = 0; i < MAX_BLOCK_PER_INODE; i++) {
+        if (is_inline && inode_d->dno_reg[i] != DNO_NONE) {
+            problem("inode %u: inline file references block %u", ino, inode_d->dno_reg[i]);
+            if (img.repair) {
+                inode_d->dno_reg[i] = DNO_NONE;
+            }
+            continue;
+        }
+        check_block(ino, i, &inode_d->dno_reg[i]);
+    }
+}
+
+static void check_record(uint32_t ino, struct fs_inode_d *inode_d) {
+    if (img.csum_off != 0 && record_csum(inode_d) != inode_tail(inode_d)->csum) {
+        problem("inode %u: record fails its checksum", ino);
+    }
+    if (inode_d->ino != ino) {
+        problem("inode %u: record says inode %u", ino, inode_d->ino);
+        if (img.repair) {
+            inode_d->ino = ino;
+        }
+    }
+}
+
+static void queue_push(uint32_t ino) {
+    pthread_mutex_lock(&queue.lock);
+    if (queue.n == queue.cap) {
+        queue.cap = queue.cap ? queue.cap * 2 : 256;
+        queue.items = (uint32_t *)realloc(queue.items, queue.cap * sizeof(uint32_t));
+    }
+    queue.items[queue.n++] = ino;
+    pthread_cond_signal(&queue.cond);
+    pthread_mutex_unlock(&queue.lock);
+}
+
+/**
+ * @brief Check the child entry found in directory dir
+ * @return 0 if the entry has to be removed from the directory
+ */
+static int check_child(uint32_t dir, const char *name, uint32_t ino, int ftype) {
+    if (ino >= img.max_ino) {
+        problem("directory %u: entry '%s' points to inode %u out of range", dir, name, ino);
+        return 0;
+    }
+    if (ftype != FT_REG && ftype != FT_DIR) {
+        problem("directory %u: entry '%s' has bad type %d", dir, name, ftype);
+        return 0;
+    }
+    struct fs_inode_d *inode_d = inode_at(ino);
+    if (inode_d == NULL) {
+        problem("directory %u: entry '%s' points to inode %u, which has no record", dir, name, ino);
+        return 0;
+    }
+    if (ref_set(img.ino_ref, ino)) {
+        problem("directory %u: entry '%s' links inode %u, which is already linked", dir, name, ino);
+        return 0;
+    }
+    check_record(ino, inode_d);
+    if (ftype == FT_DIR) {
+        queue_push(ino);
+    } else {
+        check_file(ino, inode_d);
+    }
+    return 1;
+}
+
+/**
+ * @brief Check a directory and its entries, dropping the broken ones
+ * @attention Each directory is checked by exactly one worker, which owns its
+ *            records while doing so
+ */
+static void check_dir(uint32_t ino) {
+    struct fs_inode_d *inode_d = inode_at(ino);
+    int is_inline = has_flags() && (inode_d->flags & INODE_INLINE) && inode_d->dno_dir == DNO_NONE;
+    int is_v0 = (img.version == FS_VERSION_V0 && inode_d->size == 0);
+    int capacity = is_inline ? (int)img.inline_max : (int)img.size_block;
+
+    __atomic_fetch_add(&stats.dirs, 1, __ATOMIC_RELAXED);
+    for (int i = 0; i < MAX_BLOCK_PER_INODE; i++) {
+        check_block(ino, i, &inode_d->dno_reg[i]);
+    }
+
+    uint8_t *records = NULL;
+    if (is_inline) {
+        records = inode_d->inline_data;
+    } else if (inode_d->dno_dir != DNO_NONE && check_block(ino, -1, &inode_d->dno_dir)) {
+        records = block_at(inode_d->dno_dir & ~DNO_UNWRITTEN);
+    }
+    int size = is_v0 ? inode_d->dir_cnt * (int)sizeof(struct fs_dentry_d_v0) : inode_d->size;
+    if (records == NULL || size < 0 || size > capacity) {
+        if (inode_d->dir_cnt != 0 || inode_d->size != 0) {
+            problem("directory %u: %d entries in %d bytes that cannot be read", ino, inode_d->dir_cnt, size);
+            if (img.repair) {
+                inode_d->dir_cnt = 0;
+                inode_d->size = 0;
+            }
+        }
+        return;
+    }
+    if (img.csum_off != 0 && !is_inline && size > 0 && crc32c(0, records, size) != inode_tail(inode_d)->dir_csum) {
+        problem("directory %u: block %u fails its checksum", ino, inode_d->dno_dir);
+    }
+
+    // Good records are moved down over dropped ones
+    int cur = 0, kept = 0, parsed = 0, kept_cnt = 0;
+    char name[MAX_NAME_LEN + 1];
+    for (int i = 0; i < inode_d->dir_cnt; i++) {
+        uint32_t child;
+        int ftype, rec_len;
+        if (is_v0) {
+            struct fs_dentry_d_v0 *child_d = (struct fs_dentry_d_v0 *)(records + cur);
+            rec_len = sizeof(struct fs_dentry_d_v0);
+            if (cur + rec_len > size) {
+                break;
+            }
+            memcpy(name, child_d->name, MAX_NAME_LEN);
+            name[MAX_NAME_LEN] = '\0';
+            child = child_d->ino;
+            ftype = child_d->ftype;
+        } else {
+            struct fs_dentry_d *child_d = (struct fs_dentry_d *)(records + cur);
+            if (cur + (int)sizeof(struct fs_dentry_d) > size) {
+                break;
+            }
+            rec_len = child_d->rec_len;
+            if (rec_len % 8 != 0 || child_d->name_len == 0 ||
+                rec_len < (int)DENTRY_D_LEN(child_d->name_len) || cur + rec_len > size) {
+                break;
+            }
+            memcpy(name, child_d->name, child_d->name_len);
+            name[child_d->name_len] = '\0';
+            child = child_d->ino;
+            ftype = child_d->ftype;
+        }
+        if (check_child(ino, name, child, ftype)) {
+            if (img.repair && kept != cur) {
+                memmove(records + kept, records + cur, rec_len);
+            }
+            kept += rec_len;
+            kept_cnt++;
+        }
+        cur += rec_len;
+        parsed++;
+    }
+    if (!is_v0 && cur != size) {
+        problem("directory %u: records corrupt after byte %d of %d", ino, cur, size);
+    } else if (parsed != inode_d->dir_cnt) {
+        problem("directory %u: %d entries recorded, %d found", ino, inode_d->dir_cnt, parsed);
+    }
+    if (img.repair) {
+        inode_d->dir_cnt = kept_cnt;
+        if (!is_v0) {
+            inode_d->size = kept;
+        }
+    }
+}
+
+static void *worker_main(void *arg) {
+    pthread_mutex_lock(&queue.lock);
+    for (;;) {
+        while (queue.n == 0 && queue.busy > 0) {
+            pthread_cond_wait(&queue.cond, &queue.lock);
+        }
+        if (queue.n == 0) {
+            break; // * Nothing queued and nobody left to queue more
+        }
+        uint32_t ino = queue.items[--queue.n];
+        queue.busy++;
+        pthread_mutex_unlock(&queue.lock);
+
+        check_dir(ino);
+
+        pthread_mutex_lock(&queue.lock);
+        queue.busy--;
+        if (queue.n == 0 && queue.busy == 0) {
+            pthread_cond_broadcast(&queue.cond);
+        }
+    }
+    pthread_mutex_unlock(&queue.lock);
+    return NULL;
+}
+
+/**
+ * @brief The journal checksum, CRC32C since FS_VERSION 3 and FNV-1a before
+ */
+static uint32_t journal_checksum(const uint8_t *data, size_t len) {
+    if (img.super_d->version >= FS_VERSION_V3) {
+        return crc32c(0, data, len);
+    }
+    uint32_t hash = 0x811c9dc5u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * @brief Bytes of the super block covered by its checksum, as super_csum_len
+ */
+static size_t super_csum_len() {
+    return img.version >= FS_VERSION ? sizeof(struct fs_super_d) : offsetof(struct fs_super_d, log_segment);
+}
+
+/**
+ * @brief Replay a committed but not retired transaction, like journal_recover
+ */
+static void journal_replay() {
+    struct fs_super_d *super_d = img.super_d;
+    uint32_t size_block = img.size_block;
+    if (super_d->journal.blocks == 0 ||
+        (size_t)super_d->journal.offset + (size_t)super_d->journal.blocks * size_block > img.size) {
+        return;
+    }
+    struct fs_journal_d *journal_d = (struct fs_journal_d *)(img.base + super_d->journal.offset);
+    struct fs_journal_txn_d *txn_d = (struct fs_journal_txn_d *)(img.base + super_d->journal.offset + size_block);
+    uint32_t capacity = (size_block - sizeof(struct fs_journal_txn_d)) / sizeof(uint32_t);
+    if (capacity > (uint32_t)super_d->journal.blocks - 2) {
+        capacity = super_d->journal.blocks - 2;
+    }
+    if (journal_d->magic != FS_JOURNAL_MAGIC || txn_d->magic != FS_JOURNAL_MAGIC ||
+        txn_d->sequence != journal_d->sequence || txn_d->nblocks == 0 || txn_d->nblocks > capacity) {
+        return;
+    }
+
+    size_t len = (size_t)(txn_d->nblocks + 1) * size_block;
+    uint8_t *copy = (uint8_t *)malloc(len);
+    memcpy(copy, txn_d, len);
+    ((struct fs_journal_txn_d *)copy)->checksum = 0;
+    int valid = (journal_checksum(copy, len) == txn_d->checksum);
+    free(copy);
+    if (!valid) {
+        return;
+    }
+    for (uint32_t i = 0; i < txn_d->nblocks; i++) {
+        if ((size_t)(txn_d->blocknr[i] + 1) * size_block <= img.size) {
+            memcpy(img.base + (size_t)txn_d->blocknr[i] * size_block,
+                   (uint8_t *)txn_d + (size_t)(i + 1) * size_block, size_block);
+        }
+    }
+    printf("journal: replayed transaction %u, %u blocks\n", txn_d->sequence, txn_d->nblocks);
+    journal_d->sequence++;
+}
+
+/**
+ * @brief Derive the geometry from the super block
+ * @return 0 if the super block is unusable
+ */
+static int load_super() {
+    if (img.size < sizeof(struct fs_super_d)) {
+        return 0;
+    }
+    struct fs_super_d *super_d = (struct fs_super_d *)img.base;
+    img.super_d = super_d;
+    if (super_d->magic != FS_MAGIC || super_d->param.size_block <= 0) {
+        return 0;
+    }
+    img.version = super_d->version;
+    img.size_block = super_d->param.size_block;
+    img.max_ino = super_d->param.max_ino;
+    img.max_dno = super_d->param.max_dno;
+    img.imap_off = super_d->imap.offset;
+    img.dmap_off = super_d->dmap.offset;
+    img.inodes_off = super_d->inodes.offset;
+    img.data_off = super_d->data.offset;
+    img.csum_off = img.version >= FS_VERSION_V3 ? super_d->csum.offset : 0;
+    img.log_segment = img.version >= FS_VERSION ? super_d->log_segment : 0;
+    if (super_d->groups == 0) {
+        img.groups = 1;
+        img.ipg = img.max_ino;
+        img.dpg = img.max_dno;
+        img.group_size = 0;
+    } else {
+        img.groups = super_d->groups;
+        img.ipg = super_d->inodes_per_group;
+        img.dpg = super_d->blocks_per_group;
+        img.group_size = (off_t)super_d->group_blocks * img.size_block;
+    }
+    img.inode_size = super_d->inode_size ? super_d->inode_size : offsetof(struct fs_inode_d, flags);
+    img.inline_max = 0;
+    if (img.inode_size > offsetof(struct fs_inode_d, inline_data)) {
+        img.inline_max = img.inode_size - offsetof(struct fs_inode_d, inline_data);
+    }
+    if (img.csum_off != 0) {
+        img.inline_max -= sizeof(struct fs_inode_tail_d);
+    }
+    if (img.ipg == 0 || img.dpg == 0 || img.inode_size > sizeof(struct fs_inode_d)) {
+        return 0;
+    }
+    img.rec_per_block = img.size_block / img.inode_size;
+
+    // The last group must lie within the image
+    off_t last = (off_t)(img.groups - 1) * img.group_size;
+    uint32_t entry_size = img.log_segment != 0 ? sizeof(uint32_t) : img.inode_size;
+    return (size_t)(last + img.inodes_off + (off_t)img.ipg * entry_size) <= img.size &&
+           (size_t)(last + img.data_off + (off_t)img.dpg * img.size_block) <= img.size;
+}
+
+/**
+ * @brief Reference the blocks holding the records of reached inodes, and
+ *        drop the table entries of unreached ones
+ */
+static void check_itab() {
+    uint64_t *rec_ref = (uint64_t *)calloc(img.max_dno / 64 + 1, sizeof(uint64_t));
+    uint32_t stale = 0;
+    for (uint32_t ino = 0; ino < img.max_ino; ino++) {
+        uint32_t *entry = itab_at(ino);
+        if (*entry == DNO_NONE) {
+            continue;
+        }
+        if (!ref_test(img.ino_ref, ino)) {
+            stale++;
+            if (img.repair) {
+                *entry = DNO_NONE;
+            }
+        } else {
+            ref_set(rec_ref, *entry / img.rec_per_block); // * Reached, so in range
+        }
+    }
+    if (stale) {
+        problem("inode table: %u entries for unreferenced inodes", stale);
+    }
+    for (uint32_t dno = 0; dno < img.max_dno; dno++) {
+        if (ref_test(rec_ref, dno) && ref_set(img.dno_ref, dno)) {
+            printf("block %u holds inode records and is also used by an inode\n", dno);
+            stats.errors++;
+        }
+    }
+    free(rec_ref);
+}
+
+/**
+ * @brief Reference one block owned by the snapshot
+ */
+static void snap_ref(uint32_t dno, const char *what) {
+    if (dno >= img.max_dno) {
+        printf("snapshot: %s %u out of range\n", what, dno);
+        stats.errors++;
+    } else if (ref_set(img.dno_ref, dno)) {
+        printf("snapshot: %s %u is also used by an inode\n", what, dno);
+        stats.errors++;
+    }
+}
+
+/**
+ * @brief Reference the map of the snapshot and every copy it points to
+ * @attention Repairs are made in place, blocks the snapshot still shares
+ *            are not copied for it first
+ */
+static void check_snapshot() {
+    struct fs_super_d *super_d = img.super_d;
+    if (super_d->snap_blocks == 0) {
+        return;
+    }
+    uint32_t per_block = img.size_block / sizeof(uint32_t);
+    uint32_t nleaves = ((uint32_t)super_d->param.size_disk / img.size_block + per_block - 1) / per_block;
+    if (super_d->snap_dir + super_d->snap_blocks > img.max_dno || nleaves > super_d->snap_blocks * per_block) {
+        printf("snapshot: bad map directory at %u\n", super_d->snap_dir);
+        stats.errors++;
+        return;
+    }
+    uint32_t copies = 0;
+    for (uint32_t i = 0; i < super_d->snap_blocks; i++) {
+        snap_ref(super_d->snap_dir + i, "map directory");
+    }
+    for (uint32_t idx = 0; idx < nleaves; idx++) {
+        uint32_t leaf = ((uint32_t *)block_at(super_d->snap_dir + idx / per_block))[idx % per_block];
+        if (leaf == DNO_NONE) {
+            continue;
+        }
+        snap_ref(leaf, "map leaf");
+        if (leaf >= img.max_dno) {
+            continue;
+        }
+        uint32_t *entries = (uint32_t *)block_at(leaf);
+        for (uint32_t i = 0; i < per_block; i++) {
+            if (entries[i] != DNO_NONE) {
+                snap_ref(entries[i], "copy");
+                copies++;
+            }
+        }
+    }
+    printf("snapshot of generation %u: %u blocks copied\n", super_d->snap_generation, copies);
+}
+
+/**
+ * @brief Give each later claimant of a shared block its own copy
+ */
+static void clone_dups() {
+    uint32_t next = 0;
+    for (uint32_t i = 0; i < dups.n; i++) {
+        struct fs_inode_d *inode_d = inode_at(dups.items[i].ino);
+        uint32_t *dno = dups.items[i].slot < 0 ? &inode_d->dno_dir : &inode_d->dno_reg[dups.items[i].slot];
+        uint32_t shared = *dno & ~DNO_UNWRITTEN;
+
+        while (next < img.max_dno && ref_test(img.dno_ref, next)) {
+            next++;
+        }
+        if (!img.repair || next == img.max_dno) {
+            printf("inode %u: block %u is also used by another inode\n", dups.items[i].ino, shared);
+            stats.errors++;
+            continue;
+        }
+        memcpy(block_at(next), block_at(shared), img.size_block);
+        *dno = next | (*dno & DNO_UNWRITTEN);
+        ref_set(img.dno_ref, next);
+        problem("inode %u: block %u is also used by another inode, copied to %u",
+                dups.items[i].ino, shared, next);
+    }
+}
+
+/**
+ * @brief Compare one on-disk bitmap with the references found by the walk
+ */
+static void check_map(const char *what, off_t map_off, uint32_t per_group, uint32_t count, const uint64_t *ref) {
+    uint32_t leaked = 0, missing = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        uint8_t bit;
+        uint8_t *byte = map_byte(map_off, per_group, i, &bit);
+        int used = (*byte & bit) != 0;
+        if (used == ref_test(ref, i)) {
+            continue;
+        }
+        if (used) {
+            leaked++;
+        } else {
+            missing++;
+        }
+        if (img.repair) {
+            *byte ^= bit;
+        }
+    }
+    if (leaked) {
+        problem("%s bitmap: %u marked in use but unreferenced", what, leaked);
+    }
+    if (missing) {
+        problem("%s bitmap: %u in use but marked free", what, missing);
+    }
+}
+
+/**
+ * @brief Fill the checksum block of group g, as csum_pack does
+ */
+static void csum_pack(uint32_t g, uint32_t *csums) {
+    struct fs_super_d *super_d = img.super_d;
+    uint32_t nmaps = super_d->imap.blocks + super_d->dmap.blocks;
+    memset(csums, 0, img.size_block);
+    for (uint32_t k = 0; img.log_segment != 0 && k < (uint32_t)super_d->inodes.blocks; k++) {
+        uint32_t slice = img.ipg * sizeof(uint32_t);
+        uint32_t len = slice - k * img.size_block < img.size_block ? slice - k * img.size_block : img.size_block;
+        off_t off = img.inodes_off + (off_t)g * img.group_size + (off_t)k * img.size_block;
+        csums[nmaps + k] = crc32c(0, img.base + off, len);
+    }
+    for (uint32_t k = 0; k < nmaps; k++) {
+        int is_imap = k < (uint32_t)super_d->imap.blocks;
+        uint32_t blk = is_imap ? k : k - super_d->imap.blocks;
+        uint32_t count = is_imap ? img.max_ino : img.max_dno;
+        uint32_t per_group = is_imap ? img.ipg : img.dpg;
+        uint32_t slice = img.groups == 1 ? (count + 7) / 8 : per_group / 8;
+        uint32_t len = slice - blk * img.size_block < img.size_block ? slice - blk * img.size_block : img.size_block;
+        off_t off = (is_imap ? img.imap_off : img.dmap_off) + (off_t)g * img.group_size + (off_t)blk * img.size_block;
+        csums[k] = crc32c(0, img.base + off, len);
+    }
+}
+
+/**
+ * @brief Verify the bitmap checksums of every group, before any repair of the bitmaps
+ */
+static void check_csums() {
+    uint32_t *csums = (uint32_t *)malloc(img.size_block);
+    for (uint32_t g = 0; g < img.groups; g++) {
+        csum_pack(g, csums);
+        uint8_t *stored = img.base + img.csum_off + (off_t)g * img.group_size;
+        if (memcmp(stored, csums, img.size_block) != 0) {
+            problem(img.log_segment ? "group %u: bitmaps or inode table fail their checksum" :
+                    "group %u: bitmaps fail their checksum", g);
+        }
+    }
+    free(csums);
+}
+
+/**
+ * @brief Stamp every checksum again after a repair
+ * @attention Only reached inodes are stamped, the others are free and never read
+ */
+static void stamp_csums() {
+    uint32_t *csums = (uint32_t *)malloc(img.size_block);
+    for (uint32_t g = 0; g < img.groups; g++) {
+        csum_pack(g, csums);
+        memcpy(img.base + img.csum_off + (off_t)g * img.group_size, csums, img.size_block);
+    }
+    free(csums);
+    for (uint32_t ino = 0; ino < img.max_ino; ino++) {
+        if (!ref_test(img.ino_ref, ino)) {
+            continue;
+        }
+        struct fs_inode_d *inode_d = inode_at(ino);
+        if (inode_d->dno_dir != DNO_NONE && (inode_d->dno_dir & ~DNO_UNWRITTEN) < img.max_dno &&
+            inode_d->size > 0 && inode_d->size <= (int)img.size_block) {
+            inode_tail(inode_d)->dir_csum = crc32c(0, block_at(inode_d->dno_dir & ~DNO_UNWRITTEN), inode_d->size);
+        }
+        inode_tail(inode_d)->csum = 0;
+        inode_tail(inode_d)->csum = crc32c(0, inode_d, img.inode_size);
+    }
+}
+
+int main(int argc, char **argv) {
+    int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+    img.repair = 0;
+    while ((opt = getopt(argc, argv, "nyj:")) != -1) {
+        switch (opt) {
+            case 'n': img.repair = 0; break;
+            case 'y': img.repair = 1; break;
+            case 'j': threads = atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-n | -y] [-j threads] image\n", argv[0]);
+                return FSCK_ERROR;
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "usage: %s [-n | -y] [-j threads] image\n", argv[0]);
+        return FSCK_ERROR;
+    }
+    if (threads < 1) {
+        threads = 1;
+    }
+
+    int fd = open(argv[optind], img.repair ? O_RDWR : O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror(argv[optind]);
+        return FSCK_ERROR;
+    }
+    img.size = st.st_size;
+    // * Private pages take the repairs of a dry run without touching the image
+    img.base = (uint8_t *)mmap(NULL, img.size, PROT_READ | PROT_WRITE,
+                               img.repair ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+    if (img.base == MAP_FAILED) {
+        perror("mmap");
+        return FSCK_ERROR;
+    }
+    if (!load_super()) {
+        fprintf(stderr, "%s: bad super block\n", argv[optind]);
+        return FSCK_ERROR;
+    }
+    if (img.super_d->state != FS_STATE_CLEAN) {
+        printf("%s was not unmounted cleanly (generation %u)\n", argv[optind], img.super_d->generation);
+    }
+    if (img.csum_off != 0) {
+        uint32_t checksum = img.super_d->checksum;
+        img.super_d->checksum = 0;
+        if (crc32c(0, img.super_d, super_csum_len()) != checksum) {
+            problem("super block fails its checksum");
+        }
+        img.super_d->checksum = checksum;
+    }
+    journal_replay();
+
+    img.ino_ref = (uint64_t *)calloc(img.max_ino / 64 + 1, sizeof(uint64_t));
+    img.dno_ref = (uint64_t *)calloc(img.max_dno / 64 + 1, sizeof(uint64_t));
+
+    // Pass 1: walk the tree from root, which is inode 0
+    if (inode_at(0) == NULL) {
+        fprintf(stderr, "%s: root has no record\n", argv[optind]);
+        return FSCK_ERROR;
+    }
+    ref_set(img.ino_ref, 0);
+    check_record(0, inode_at(0));
+    queue_push(0);
+    pthread_t *pool = (pthread_t *)malloc(threads * sizeof(pthread_t));
+    for (int i = 0; i < threads; i++) {
+        pthread_create(&pool[i], NULL, worker_main, NULL);
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(pool[i], NULL);
+    }
+    free(pool);
+
+    // Pass 2: the bitmap checksums, the record blocks, the snapshot, shared
+    // blocks, then the bitmaps against the references
+    if (img.csum_off != 0) {
+        check_csums();
+    }
+    if (img.log_segment != 0) {
+        check_itab();
+    }
+    check_snapshot();
+    clone_dups();
+    check_map("inode", img.imap_off, img.ipg, img.max_ino, img.ino_ref);
+    check_map("data", img.dmap_off, img.dpg, img.max_dno, img.dno_ref);
+
+    printf("%s: %llu directories, %llu files, %llu blocks, %llu errors, %llu fixed\n", argv[optind],
+           (unsigned long long)stats.dirs, (unsigned long long)stats.files,
+           (unsigned long long)stats.blocks, (unsigned long long)stats.errors,
+           (unsigned long long)stats.fixed);
+
+    if (img.repair && stats.errors == stats.fixed) {
+        img.super_d->state = FS_STATE_CLEAN;
+        if (img.csum_off != 0) {
+            stamp_csums();
+            img.super_d->checksum = 0;
+            img.super_d->checksum = crc32c(0, img.super_d, super_csum_len());
+        }
+        msync(img.base, img.size, MS_SYNC);
+    }
+    munmap(img.base, img.size);
+    close(fd);
+    free(img.ino_ref);
+    free(img.dno_ref);
+    free(queue.items);
+    free(dups.items);
+
+    if (stats.errors == 0) {
+        return FSCK_OK;
+    }
+    return stats.errors == stats.fixed ? FSCK_CORRECTED : FSCK_UNCORRECTED;
+}